@@ -0,0 +1,612 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A regression benchmark for the Firebase C++ SDK. It runs a fixed set of
+// scenarios against the Firestore Emulator, each several times in a fresh
+// process of the test app, and compares the latencies and throughputs that
+// the test app reports in its CSV results with those stored in a baseline
+// file. A scenario regresses when a one-sided Mann-Whitney U test finds its
+// samples significantly worse than the baseline's and the median has moved
+// by more than a minimum relative change, so that noise alone rarely fails a
+// run and a significant but negligible shift never does.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr char kBaselineHeader[] = "# firebase_unity_issue_1154_benchmark v2";
+
+// One fixed workload, and which of the operations it records are measured.
+struct Scenario {
+  const char* name;
+  // The arguments given to the test app, after the benchmark's own.
+  std::vector<std::string> arguments;
+  // The "operation" and "phase" columns of the measured records.
+  const char* operation;
+  const char* phase;
+  // Whether the scenario runs long enough for its throughput to mean
+  // anything; the cold scenarios each measure a single operation.
+  bool measure_throughput;
+};
+
+const std::vector<Scenario>& Scenarios() {
+  static const std::vector<Scenario> scenarios = {
+      {"cold-first-read", {"read"}, "read", "first", false},
+      {"cold-first-write", {"write"}, "write", "first", false},
+      {"steady-read", {"write", "read*200"}, "read", "steady", true},
+      {"steady-write", {"write*200"}, "write", "steady", true},
+      {"batch", {"--batch-size", "10", "write*200"}, "batch write", "steady",
+       true},
+      {"listener", {"write", "listen*50"}, "listen", "steady", true},
+      {"transaction", {"txn*50"}, "txn", "steady", true},
+      {"drain-enqueue", {"write", "drain"}, "drain enqueue", "steady", true},
+  };
+  return scenarios;
+}
+
+// The samples of one scenario, one per repetition: the p50 and p90 latency of
+// its measured operations, in nanoseconds, and its throughput, in operations
+// per second. The operations of one process share a connection and a cache,
+// so only whole repetitions are independent enough to test against each
+// other.
+struct ScenarioResult {
+  std::vector<double> p50_ns;
+  std::vector<double> p90_ns;
+  std::vector<double> throughputs;
+};
+
+typedef std::map<std::string, ScenarioResult> Results;
+
+struct Arguments {
+  std::string app;
+  std::string baseline_file = "benchmark_baseline.txt";
+  bool record_baseline = false;
+  int repetitions = 10;
+  double alpha = 0.01;
+  double min_change = 0.05;
+  std::vector<std::string> scenarios;
+  bool show_help = false;
+};
+
+class ArgParseException : public std::runtime_error {
+ public:
+  explicit ArgParseException(const std::string& message)
+      : std::runtime_error(message) {}
+};
+
+double ParseDouble(const std::string& option, const std::string& text,
+                   double min, double max) {
+  char* end = nullptr;
+  double value = std::strtod(text.c_str(), &end);
+  if (text.empty() || *end != '\0' || !(value > min) || !(value < max)) {
+    throw ArgParseException("invalid value for " + option + ": " + text);
+  }
+  return value;
+}
+
+int ParsePositiveInt(const std::string& option, const std::string& text) {
+  char* end = nullptr;
+  long value = std::strtol(text.c_str(), &end, 10);
+  if (text.empty() || *end != '\0' || value < 1 || value > 1000000) {
+    throw ArgParseException("invalid value for " + option + ": " + text +
+                            " (must be a positive integer)");
+  }
+  return static_cast<int>(value);
+}
+
+// The test app is expected next to the benchmark unless --app says otherwise.
+std::string DefaultAppPath(const char* argv0) {
+  std::string path = argv0;
+  std::size_t slash = path.find_last_of("/\\");
+  std::string directory =
+      slash == std::string::npos ? "." : path.substr(0, slash);
+#ifdef _WIN32
+  return directory + "\\firebase_unity_issue_1154_test_app.exe";
+#else
+  return directory + "/firebase_unity_issue_1154_test_app";
+#endif
+}
+
+Arguments ParseArguments(int argc, char** argv) {
+  Arguments args;
+  args.app = DefaultAppPath(argv[0]);
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg == "-h" || arg == "--help") {
+      args.show_help = true;
+      continue;
+    } else if (arg == "--record-baseline") {
+      args.record_baseline = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      throw ArgParseException(
+          arg.compare(0, 2, "--") == 0
+              ? "expected argument after " + arg
+              : "invalid argument: " + arg + " (run with --help for help)");
+    }
+    const std::string value = argv[++i];
+    if (arg == "--app") {
+      args.app = value;
+    } else if (arg == "--baseline") {
+      args.baseline_file = value;
+    } else if (arg == "--repetitions") {
+      args.repetitions = ParsePositiveInt(arg, value);
+    } else if (arg == "--alpha") {
+      args.alpha = ParseDouble(arg, value, 0, 1);
+    } else if (arg == "--min-change") {
+      args.min_change = ParseDouble(arg, value, -1e-9, 1e9);
+    } else if (arg == "--scenario") {
+      bool known = false;
+      for (const Scenario& scenario : Scenarios()) {
+        known = known || value == scenario.name;
+      }
+      if (!known) {
+        throw ArgParseException("unknown scenario: " + value +
+                                " (run with --help for the list)");
+      }
+      args.scenarios.push_back(value);
+    } else {
+      throw ArgParseException("invalid argument: " + arg +
+                              " (run with --help for help)");
+    }
+  }
+  return args;
+}
+
+std::string HelpText(const char* argv0) {
+  std::ostringstream ss;
+  ss << "Syntax: " << argv0 << " [options]" << std::endl;
+  ss << std::endl;
+  ss << "Runs each benchmark scenario against the Firestore" << std::endl;
+  ss << "Emulator and compares its latency and throughput" << std::endl;
+  ss << "with the baseline file, exiting with 1 if any" << std::endl;
+  ss << "scenario has regressed. The first run, or a run" << std::endl;
+  ss << "with --record-baseline, writes the baseline instead." << std::endl;
+  ss << std::endl;
+  ss << "Options:" << std::endl;
+  ss << "  --app <path>" << std::endl;
+  ss << "    The test app to run (default: the one next to" << std::endl;
+  ss << "    this executable)." << std::endl;
+  ss << "  --baseline <file>" << std::endl;
+  ss << "    The baseline file (default: benchmark_baseline.txt)." << std::endl;
+  ss << "  --record-baseline" << std::endl;
+  ss << "    Replace the baseline with this run's results." << std::endl;
+  ss << "  --repetitions <N>" << std::endl;
+  ss << "    Run each scenario N times (default: 10)." << std::endl;
+  ss << "  --alpha <P>" << std::endl;
+  ss << "    The significance level (default: 0.01)." << std::endl;
+  ss << "  --min-change <F>" << std::endl;
+  ss << "    Ignore median changes smaller than the fraction F" << std::endl;
+  ss << "    of the baseline (default: 0.05)." << std::endl;
+  ss << "  --scenario <name>" << std::endl;
+  ss << "    Run only the named scenario; may be repeated." << std::endl;
+  ss << std::endl;
+  ss << "Scenarios:" << std::endl;
+  for (const Scenario& scenario : Scenarios()) {
+    ss << "  " << std::left << std::setw(18) << scenario.name;
+    for (const std::string& argument : scenario.arguments) {
+      ss << ' ' << argument;
+    }
+    ss << std::endl;
+  }
+  return ss.str();
+}
+
+std::string Quote(const std::string& text) { return "\"" + text + "\""; }
+
+// The nearest-rank percentile of `samples`, which must not be empty.
+double Percentile(std::vector<double> samples, double percentile) {
+  std::sort(samples.begin(), samples.end());
+  std::size_t rank = static_cast<std::size_t>(
+      std::ceil(percentile / 100 * static_cast<double>(samples.size())));
+  return samples[std::max<std::size_t>(rank, 1) - 1];
+}
+
+// Splits one line of the test app's CSV results. Only doc_path and error can
+// be quoted, and neither contains a doubled quote in practice, but both are
+// handled anyway.
+std::vector<std::string> SplitCsvLine(const std::string& line) {
+  std::vector<std::string> fields(1);
+  bool quoted = false;
+  for (std::size_t i = 0; i < line.size(); i++) {
+    char c = line[i];
+    if (quoted) {
+      if (c == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+        fields.back() += '"';
+        i++;
+      } else if (c == '"') {
+        quoted = false;
+      } else {
+        fields.back() += c;
+      }
+    } else if (c == '"') {
+      quoted = true;
+    } else if (c == ',') {
+      fields.emplace_back();
+    } else if (c != '\r') {
+      fields.back() += c;
+    }
+  }
+  return fields;
+}
+
+// Runs `scenario` once in a new process of the test app and appends its
+// samples to `result`. Returns false, keeping the test app's log, if the run
+// fails or records nothing to measure.
+bool RunOnce(const Arguments& args, const Scenario& scenario,
+             ScenarioResult& result) {
+  const std::string results_file = "benchmark_run.csv";
+  const std::string log_file = "benchmark_run.log";
+  std::string command = Quote(args.app) + " --emulator --output-format csv" +
+                        " --output-file " + Quote(results_file);
+  for (const std::string& argument : scenario.arguments) {
+    command += " " + Quote(argument);
+  }
+  command += " > " + Quote(log_file) + " 2>&1";
+#ifdef _WIN32
+  // cmd.exe strips the outermost quotes of the whole command line.
+  command = "\"" + command + "\"";
+#endif
+  std::remove(results_file.c_str());
+  int status = std::system(command.c_str());
+  if (status != 0) {
+    std::cout << "ERROR: " << scenario.name << " failed with status "
+              << status << "; see " << log_file << std::endl;
+    return false;
+  }
+
+  std::ifstream in(results_file);
+  std::string line;
+  std::map<std::string, std::size_t> columns;
+  if (std::getline(in, line)) {
+    std::vector<std::string> names = SplitCsvLine(line);
+    for (std::size_t i = 0; i < names.size(); i++) {
+      columns[names[i]] = i;
+    }
+  }
+  const char* required[] = {"operation", "phase", "start_ns", "end_ns",
+                            "latency_ns", "error"};
+  for (const char* name : required) {
+    if (columns.find(name) == columns.end()) {
+      std::cout << "ERROR: " << results_file << " has no " << name
+                << " column; see " << log_file << std::endl;
+      return false;
+    }
+  }
+
+  std::vector<double> latencies_ns;
+  int64_t first_start = 0;
+  int64_t last_end = 0;
+  while (std::getline(in, line)) {
+    std::vector<std::string> fields = SplitCsvLine(line);
+    if (fields.size() != columns.size() ||
+        fields[columns["operation"]] != scenario.operation ||
+        fields[columns["phase"]] != scenario.phase) {
+      continue;
+    }
+    if (fields[columns["error"]] != "kErrorOk") {
+      std::cout << "ERROR: " << scenario.name << " operation failed: "
+                << fields[columns["error"]] << "; see " << log_file
+                << std::endl;
+      return false;
+    }
+    int64_t start = std::strtoll(fields[columns["start_ns"]].c_str(),
+                                 nullptr, 10);
+    int64_t end = std::strtoll(fields[columns["end_ns"]].c_str(), nullptr, 10);
+    first_start =
+        latencies_ns.empty() ? start : std::min(first_start, start);
+    last_end = latencies_ns.empty() ? end : std::max(last_end, end);
+    latencies_ns.push_back(
+        std::strtod(fields[columns["latency_ns"]].c_str(), nullptr));
+  }
+  if (latencies_ns.empty()) {
+    std::cout << "ERROR: " << scenario.name << " recorded no " << scenario.phase
+              << " " << scenario.operation << " operations; see " << log_file
+              << std::endl;
+    return false;
+  }
+  result.p50_ns.push_back(Percentile(latencies_ns, 50));
+  result.p90_ns.push_back(Percentile(latencies_ns, 90));
+  if (scenario.measure_throughput && last_end > first_start) {
+    result.throughputs.push_back(latencies_ns.size() * 1e9 /
+                                 (last_end - first_start));
+  }
+  std::remove(results_file.c_str());
+  std::remove(log_file.c_str());
+  return true;
+}
+
+std::vector<double>* Measure(ScenarioResult& result,
+                             const std::string& measure) {
+  if (measure == "p50_ns") {
+    return &result.p50_ns;
+  } else if (measure == "p90_ns") {
+    return &result.p90_ns;
+  } else if (measure == "ops_per_second") {
+    return &result.throughputs;
+  }
+  return nullptr;
+}
+
+enum class BaselineStatus {
+  kMissing,
+  kInvalid,
+  kRead,
+};
+
+// The baseline is a line of whitespace-separated per-repetition samples per
+// scenario and measure, e.g. "steady-read p50_ns 1234 5678 ...", so that
+// later runs can be tested against the distribution rather than a summary of
+// it.
+BaselineStatus ReadBaseline(const std::string& path, Results& results) {
+  std::ifstream in(path);
+  if (!in) {
+    return BaselineStatus::kMissing;
+  }
+  std::string line;
+  if (!std::getline(in, line) || line != kBaselineHeader) {
+    return BaselineStatus::kInvalid;
+  }
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream fields(line);
+    std::string name;
+    std::string measure;
+    fields >> name >> measure;
+    std::vector<double>* samples = Measure(results[name], measure);
+    if (!samples) {
+      return BaselineStatus::kInvalid;
+    }
+    double sample;
+    while (fields >> sample) {
+      samples->push_back(sample);
+    }
+  }
+  return BaselineStatus::kRead;
+}
+
+bool WriteBaseline(const std::string& path, Results& results) {
+  std::ofstream out(path);
+  out << kBaselineHeader << std::endl;
+  out << std::setprecision(10);
+  const char* measures[] = {"p50_ns", "p90_ns", "ops_per_second"};
+  for (auto& item : results) {
+    for (const char* measure : measures) {
+      const std::vector<double>& samples = *Measure(item.second, measure);
+      if (samples.empty()) {
+        continue;
+      }
+      out << item.first << ' ' << measure;
+      for (double sample : samples) {
+        out << ' ' << sample;
+      }
+      out << std::endl;
+    }
+  }
+  return static_cast<bool>(out);
+}
+
+double Median(std::vector<double> samples) {
+  if (samples.empty()) {
+    return 0;
+  }
+  std::sort(samples.begin(), samples.end());
+  std::size_t middle = samples.size() / 2;
+  return samples.size() % 2 == 1
+             ? samples[middle]
+             : (samples[middle - 1] + samples[middle]) / 2;
+}
+
+// The one-sided p-value of `current` tending to be larger than `baseline`,
+// from the Mann-Whitney U test with the normal approximation, corrected for
+// ties and continuity. It needs no assumption about the shape of either
+// distribution, which for latencies is long-tailed and often bimodal.
+double MannWhitneyPValue(const std::vector<double>& baseline,
+                         const std::vector<double>& current) {
+  double n1 = static_cast<double>(baseline.size());
+  double n2 = static_cast<double>(current.size());
+  if (n1 == 0 || n2 == 0) {
+    return 1;
+  }
+  std::vector<std::pair<double, int>> all;
+  for (double sample : baseline) {
+    all.emplace_back(sample, 0);
+  }
+  for (double sample : current) {
+    all.emplace_back(sample, 1);
+  }
+  std::sort(all.begin(), all.end());
+
+  double current_rank_sum = 0;
+  double tie_correction = 0;
+  for (std::size_t i = 0; i < all.size();) {
+    std::size_t j = i;
+    while (j < all.size() && all[j].first == all[i].first) {
+      j++;
+    }
+    double rank = (i + 1 + j) / 2.0;
+    for (std::size_t k = i; k < j; k++) {
+      if (all[k].second == 1) {
+        current_rank_sum += rank;
+      }
+    }
+    double ties = static_cast<double>(j - i);
+    tie_correction += ties * ties * ties - ties;
+    i = j;
+  }
+
+  double n = n1 + n2;
+  double u = current_rank_sum - n2 * (n2 + 1) / 2;
+  double mean = n1 * n2 / 2;
+  double variance =
+      n1 * n2 / 12 * ((n + 1) - tie_correction / (n * (n - 1)));
+  if (variance <= 0) {
+    return 1;
+  }
+  double z = (u - mean - 0.5) / std::sqrt(variance);
+  return 0.5 * std::erfc(z / std::sqrt(2.0));
+}
+
+// Compares one measure of a scenario with its baseline, printing a line of
+// the report, and returns whether it regressed. `higher_is_worse` is true
+// for latencies and false for throughputs.
+bool Compare(const Arguments& args, const std::string& label,
+             const std::vector<double>& baseline,
+             const std::vector<double>& current, bool higher_is_worse,
+             double scale, const char* unit) {
+  if (baseline.empty() || current.empty()) {
+    std::cout << std::left << std::setw(34) << label
+              << "no baseline samples; skipped" << std::endl;
+    return false;
+  }
+  std::vector<double> worse_baseline = baseline;
+  std::vector<double> worse_current = current;
+  if (!higher_is_worse) {
+    for (double& sample : worse_baseline) {
+      sample = -sample;
+    }
+    for (double& sample : worse_current) {
+      sample = -sample;
+    }
+  }
+  double p_value = MannWhitneyPValue(worse_baseline, worse_current);
+  double baseline_median = Median(baseline);
+  double current_median = Median(current);
+  double change = baseline_median == 0
+                      ? 0
+                      : (current_median - baseline_median) / baseline_median;
+  double worse_change = higher_is_worse ? change : -change;
+  bool regressed = p_value < args.alpha && worse_change > args.min_change;
+
+  std::ostringstream medians;
+  medians << std::fixed << std::setprecision(3) << baseline_median / scale
+          << " -> " << current_median / scale << " " << unit;
+  std::cout << std::left << std::setw(34) << label << std::setw(30)
+            << medians.str() << std::right << std::fixed
+            << std::setprecision(1) << std::showpos << std::setw(7)
+            << change * 100 << "%" << std::noshowpos << std::setprecision(4)
+            << "  p=" << p_value << (regressed ? "  REGRESSION" : "")
+            << std::endl;
+  return regressed;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Arguments args;
+  try {
+    args = ParseArguments(argc, argv);
+  } catch (ArgParseException& e) {
+    std::cout << "ERROR: Invalid command-line arguments: " << e.what()
+              << std::endl;
+    return 2;
+  }
+  if (args.show_help) {
+    std::cout << HelpText(argv[0]);
+    return 0;
+  }
+
+  Results baseline;
+  BaselineStatus baseline_status = BaselineStatus::kMissing;
+  if (!args.record_baseline) {
+    baseline_status = ReadBaseline(args.baseline_file, baseline);
+    if (baseline_status == BaselineStatus::kInvalid) {
+      std::cout << "ERROR: " << args.baseline_file
+                << " is not a baseline of this version; replace it with "
+                   "--record-baseline"
+                << std::endl;
+      return 2;
+    }
+  }
+
+  Results results;
+  for (const Scenario& scenario : Scenarios()) {
+    if (!args.scenarios.empty() &&
+        std::find(args.scenarios.begin(), args.scenarios.end(),
+                  scenario.name) == args.scenarios.end()) {
+      continue;
+    }
+    std::cout << "Running " << scenario.name << " " << args.repetitions
+              << " times" << std::endl;
+    ScenarioResult& result = results[scenario.name];
+    for (int i = 0; i < args.repetitions; i++) {
+      if (!RunOnce(args, scenario, result)) {
+        return 2;
+      }
+    }
+  }
+
+  if (baseline_status != BaselineStatus::kRead) {
+    if (args.record_baseline &&
+        ReadBaseline(args.baseline_file, baseline) != BaselineStatus::kRead) {
+      // Keep the baseline of any scenario that was not run this time, unless
+      // it is unreadable.
+      baseline.clear();
+    }
+    for (const auto& item : results) {
+      baseline[item.first] = item.second;
+    }
+    if (!WriteBaseline(args.baseline_file, baseline)) {
+      std::cout << "ERROR: Writing baseline FAILED: " << args.baseline_file
+                << std::endl;
+      return 2;
+    }
+    std::cout << "Wrote baseline: " << args.baseline_file << std::endl;
+    return 0;
+  }
+
+  std::cout << "Compared with baseline " << args.baseline_file << " (alpha "
+            << args.alpha << ", minimum change " << args.min_change * 100
+            << "%):" << std::endl;
+  int regressions = 0;
+  for (const auto& item : results) {
+    const ScenarioResult& base = baseline[item.first];
+    regressions += Compare(args, item.first + " p50 latency", base.p50_ns,
+                           item.second.p50_ns, true, 1e6, "ms");
+    if (!item.second.throughputs.empty()) {
+      // Each repetition of the cold scenarios has a single operation, whose
+      // p90 is its p50.
+      regressions += Compare(args, item.first + " p90 latency", base.p90_ns,
+                             item.second.p90_ns, true, 1e6, "ms");
+      regressions += Compare(args, item.first + " throughput",
+                             base.throughputs, item.second.throughputs, false,
+                             1, "ops/s");
+    }
+  }
+  if (regressions > 0) {
+    std::cout << regressions << " significant regression"
+              << (regressions == 1 ? "" : "s") << " found" << std::endl;
+    return 1;
+  }
+  std::cout << "No significant regressions found" << std::endl;
+  return 0;
+}
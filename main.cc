@@ -14,20 +14,67 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <atomic>
 #include <cctype>
 #include <chrono>
+#include <cmath>
 #include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <deque>
 #include <exception>
+#include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <new>
+#include <queue>
+#include <random>
 #include <sstream>
+#include <stdexcept>
+#include <streambuf>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <malloc.h>
+#include <psapi.h>
+#include <tlhelp32.h>
+#else
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+#endif
+
 #include "firebase/app.h"
+#include "firebase/auth.h"
 #include "firebase/firestore.h"
 
 using ::firebase::App;
@@ -37,341 +84,7096 @@ using ::firebase::FutureBase;
 using ::firebase::FutureStatus;
 using ::firebase::LogLevel;
 using ::firebase::SetLogLevel;
+using ::firebase::auth::Auth;
+using ::firebase::auth::User;
+using ::firebase::firestore::CollectionReference;
 using ::firebase::firestore::DocumentReference;
 using ::firebase::firestore::DocumentSnapshot;
 using ::firebase::firestore::Error;
 using ::firebase::firestore::FieldValue;
 using ::firebase::firestore::Firestore;
+using ::firebase::firestore::ListenerRegistration;
 using ::firebase::firestore::MapFieldValue;
+using ::firebase::firestore::MetadataChanges;
+using ::firebase::firestore::Query;
+using ::firebase::firestore::QuerySnapshot;
+using ::firebase::firestore::SetOptions;
 using ::firebase::firestore::Settings;
 using ::firebase::firestore::Source;
+using ::firebase::firestore::Transaction;
+using ::firebase::firestore::WriteBatch;
 
 enum class Operation {
   kRead,
   kWrite,
+  // Consecutive kWrite operations committed together in a single WriteBatch.
+  kBatchWrite,
+  // A write whose latency is measured until snapshot listeners observe it.
+  kListen,
+  // A read-modify-write transaction incrementing a counter in a hot document.
+  kTransaction,
+  // The same increment as a single Set() of FieldValue::Increment().
+  kIncrement,
+  // A paginated query over the whole collection, recorded once per page.
+  kQuery,
+  // Concurrent writes to several documents, awaited together; its latency is
+  // that of the slowest write.
+  kFanOut,
+  // One of the writes of a kFanOut.
+  kFanOutDocument,
+  // Writes queued with the network disabled, measured from re-enabling it
+  // until the last of them is acknowledged.
+  kDrain,
+  // One of the writes of a kDrain, measured from re-enabling the network.
+  kDrainWrite,
+  // The local Set() that queued one of the writes of a kDrain while the
+  // network was disabled.
+  kDrainEnqueue,
 };
 
-std::string FormattedTimestamp() {
-  auto timestamp = std::chrono::system_clock::now();
-  std::time_t ctime_timestamp = std::chrono::system_clock::to_time_t(timestamp);
-  std::string formatted_timestamp(std::ctime(&ctime_timestamp));
-  while (formatted_timestamp.size() > 0) {
-    auto last_char = formatted_timestamp[formatted_timestamp.size() - 1];
-    if (!std::isspace(last_char)) {
-      break;
-    }
-    formatted_timestamp.pop_back();
+std::string OperationKindName(Operation operation) {
+  switch (operation) {
+    case Operation::kRead:
+      return "read";
+    case Operation::kWrite:
+      return "write";
+    case Operation::kBatchWrite:
+      return "batch write";
+    case Operation::kListen:
+      return "listen";
+    case Operation::kTransaction:
+      return "txn";
+    case Operation::kIncrement:
+      return "increment";
+    case Operation::kQuery:
+      return "query";
+    case Operation::kFanOut:
+      return "fanout";
+    case Operation::kFanOutDocument:
+      return "fanout doc";
+    case Operation::kDrain:
+      return "drain";
+    case Operation::kDrainWrite:
+      return "drain write";
+    case Operation::kDrainEnqueue:
+      return "drain enqueue";
   }
-  return formatted_timestamp;
-}
-
-template <typename T>
-void Log0(T message) {
-  std::cout << message << std::endl;
+  return std::to_string(static_cast<int>(operation));
 }
 
-template <typename T, typename... U>
-void Log0(T message, U... rest) {
-  std::cout << message;
-  Log0(rest...);
-}
+// Formats wall-clock timestamps for log lines in `ctime()` style with
+// sub-second precision, e.g. "Wed Oct 13 14:02:17.123 2021". The part of the
+// output that depends only on the whole second is rendered with
+// `localtime_r()`/`localtime_s()` and cached per thread, so formatting a
+// timestamp in the same second as the previous one on that thread only
+// renders the fractional digits. Output goes into a caller-provided buffer and
+// no memory is allocated, so it is safe and cheap to call from any thread,
+// including the Firestore callback threads.
+class TimestampFormatter {
+ public:
+  enum class Precision {
+    kMilliseconds,
+    kMicroseconds,
+  };
 
-template <typename... T>
-void Log(T... messages) {
-  std::cout << ">>>>> " << FormattedTimestamp() << " -- ";
-  Log0(messages...);
-}
+  static constexpr std::size_t kBufferSize = 48;
 
-class AwaitableFutureCompletion {
- public:
-  AwaitableFutureCompletion(FutureBase& future) : future_(future) {
-    future.OnCompletion(OnCompletion);
+  static void set_precision(Precision precision) {
+    precision_.store(precision, std::memory_order_relaxed);
   }
 
-  void AwaitInvoked() const {
-    std::unique_lock<std::mutex> lock(mutex_);
-    condition_.wait(lock, [this]() {
-      return future_.status() != FutureStatus::kFutureStatusPending;
-    });
+  // Writes the NUL-terminated timestamp into `buffer` and returns its length.
+  static std::size_t Format(std::chrono::system_clock::time_point timestamp,
+                            char (&buffer)[kBufferSize]) {
+    auto since_epoch = timestamp.time_since_epoch();
+    auto whole_seconds =
+        std::chrono::duration_cast<std::chrono::seconds>(since_epoch);
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                      since_epoch - whole_seconds)
+                      .count();
+    if (micros < 0) {
+      whole_seconds -= std::chrono::seconds(1);
+      micros += 1000000;
+    }
+    std::time_t second = std::chrono::system_clock::to_time_t(
+        std::chrono::system_clock::time_point(whole_seconds));
+
+    thread_local CachedSecond cache;
+    if (!cache.valid || cache.second != second) {
+      RenderSecond(second, cache);
+    }
+
+    std::size_t length = 0;
+    std::memcpy(buffer, cache.prefix, cache.prefix_length);
+    length += cache.prefix_length;
+    buffer[length++] = '.';
+    int digits = 6;
+    if (precision_.load(std::memory_order_relaxed) ==
+        Precision::kMilliseconds) {
+      digits = 3;
+      micros /= 1000;
+    }
+    for (int i = digits - 1; i >= 0; i--) {
+      buffer[length + i] = static_cast<char>('0' + micros % 10);
+      micros /= 10;
+    }
+    length += digits;
+    std::memcpy(buffer + length, cache.suffix, cache.suffix_length);
+    length += cache.suffix_length;
+    buffer[length] = '\0';
+    return length;
   }
 
  private:
-  static void OnCompletion(const FutureBase&) {
-    std::unique_lock<std::mutex> lock(mutex_);
-    condition_.notify_all();
+  struct CachedSecond {
+    bool valid = false;
+    std::time_t second = 0;
+    // The date and time up to the seconds, e.g. "Wed Oct 13 14:02:17".
+    char prefix[32];
+    std::size_t prefix_length = 0;
+    // The year, e.g. " 2021".
+    char suffix[16];
+    std::size_t suffix_length = 0;
+  };
+
+  static void RenderSecond(std::time_t second, CachedSecond& cache) {
+    std::tm local_time;
+#ifdef _WIN32
+    localtime_s(&local_time, &second);
+#else
+    localtime_r(&second, &local_time);
+#endif
+    cache.prefix_length = std::strftime(cache.prefix, sizeof(cache.prefix),
+                                        "%a %b %e %H:%M:%S", &local_time);
+    cache.suffix_length = std::strftime(cache.suffix, sizeof(cache.suffix),
+                                        " %Y", &local_time);
+    cache.second = second;
+    cache.valid = true;
   }
 
-  static std::mutex mutex_;
-  static std::condition_variable condition_;
-  FutureBase& future_;
+  static std::atomic<Precision> precision_;
 };
 
-std::mutex AwaitableFutureCompletion::mutex_;
-std::condition_variable AwaitableFutureCompletion::condition_;
+std::atomic<TimestampFormatter::Precision> TimestampFormatter::precision_{
+    TimestampFormatter::Precision::kMilliseconds};
 
-class ArgParseException : public std::exception {
+// Accumulates one log line. Lines up to `kInlineCapacity` bytes are assembled
+// entirely in the object itself, which lives on the logging thread's stack;
+// only longer lines spill over into a heap-allocated string.
+class LogLineBuffer {
  public:
-  ArgParseException(const std::string& what) : what_(what) {}
+  static constexpr std::size_t kInlineCapacity = 512;
 
-  const char* what() const noexcept override { return what_.c_str(); }
+  LogLineBuffer() {}
+  LogLineBuffer(const LogLineBuffer&) = delete;
+  LogLineBuffer& operator=(const LogLineBuffer&) = delete;
+
+  const char* data() const {
+    return overflow_.empty() ? inline_data_ : overflow_.data();
+  }
+  std::size_t size() const {
+    return overflow_.empty() ? inline_size_ : overflow_.size();
+  }
+
+  void Append(const char* data, std::size_t size) {
+    if (overflow_.empty() && inline_size_ + size <= kInlineCapacity) {
+      std::memcpy(inline_data_ + inline_size_, data, size);
+      inline_size_ += size;
+      return;
+    }
+    if (overflow_.empty()) {
+      overflow_.reserve(2 * (inline_size_ + size));
+      overflow_.assign(inline_data_, inline_size_);
+    }
+    overflow_.append(data, size);
+  }
+
+  void Append(const char* value) { Append(value, std::strlen(value)); }
+  void Append(const std::string& value) { Append(value.data(), value.size()); }
+  void Append(char value) { Append(&value, 1); }
+
+  // Formats integers the same way `std::ostream` does by default.
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value &&
+                          !std::is_same<T, char>::value &&
+                          !std::is_same<T, signed char>::value &&
+                          !std::is_same<T, unsigned char>::value>::type
+  Append(T value) {
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* begin = end;
+    bool negative = value < 0;
+    uint64_t magnitude = negative ? 0 - static_cast<uint64_t>(value)
+                                  : static_cast<uint64_t>(value);
+    do {
+      *--begin = static_cast<char>('0' + magnitude % 10);
+      magnitude /= 10;
+    } while (magnitude != 0);
+    if (negative) {
+      *--begin = '-';
+    }
+    Append(begin, end - begin);
+  }
+
+  // Formats floating point values the same way `std::ostream` does by
+  // default, that is, like printf's "%g".
+  template <typename T>
+  typename std::enable_if<std::is_floating_point<T>::value>::type Append(
+      T value) {
+    char digits[32];
+    int length = std::snprintf(digits, sizeof(digits), "%g",
+                               static_cast<double>(value));
+    if (length > 0) {
+      Append(digits, static_cast<std::size_t>(length));
+    }
+  }
+
+  // Anything else, e.g. `FieldValue`, is written with its `operator<<` through
+  // a stream whose buffer appends directly to this line.
+  template <typename T>
+  typename std::enable_if<!std::is_arithmetic<T>::value>::type Append(
+      const T& value) {
+    StreamBuf stream_buf(*this);
+    std::ostream out(&stream_buf);
+    out << value;
+  }
 
  private:
-  const std::string what_;
-};
+  class StreamBuf : public std::streambuf {
+   public:
+    explicit StreamBuf(LogLineBuffer& line) : line_(line) {}
 
-struct ParsedArguments {
-  std::vector<Operation> operations;
-  std::string key;
-  bool key_valid = false;
-  std::string value;
-  bool value_valid = false;
-  bool use_emulator = false;
-  bool debug_logging_enabled = false;
-  std::string help_text;
+   protected:
+    int_type overflow(int_type ch) override {
+      if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        line_.Append(traits_type::to_char_type(ch));
+      }
+      return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char* data, std::streamsize size) override {
+      line_.Append(data, static_cast<std::size_t>(size));
+      return size;
+    }
+
+   private:
+    LogLineBuffer& line_;
+  };
+
+  char inline_data_[kInlineCapacity];
+  std::size_t inline_size_ = 0;
+  std::string overflow_;
 };
 
-ParsedArguments ParseArguments(int argc, char** argv) {
-  ParsedArguments args;
-  bool next_is_key = false;
-  bool next_is_value = false;
-  bool show_help = false;
+// A bounded single-producer/single-consumer queue of log records. The
+// producing thread and the consuming thread each own one of the two indices,
+// so pushing and popping never take a lock.
+class LogRecordRing {
+ public:
+  struct Record {
+    std::chrono::steady_clock::time_point timestamp;
+    std::string message;
+  };
 
-  for (int i = 1; i < argc; i++) {
-    std::string arg(argv[i]);
-    if (next_is_key) {
-      args.key = arg;
-      args.key_valid = true;
-      next_is_key = false;
-    } else if (next_is_value) {
-      args.value = arg;
-      args.value_valid = true;
-      next_is_value = false;
-    } else if (arg == "read") {
-      args.operations.push_back(Operation::kRead);
-    } else if (arg == "write") {
-      args.operations.push_back(Operation::kWrite);
-    } else if (arg == "-k" || arg == "--key") {
-      next_is_key = true;
-    } else if (arg == "-v" || arg == "--value") {
-      next_is_value = true;
-    } else if (arg == "-e" || arg == "--emulator") {
-      args.use_emulator = true;
-    } else if (arg == "-d" || arg == "--debug") {
-      args.debug_logging_enabled = true;
-    } else if (arg == "-h" || arg == "--help") {
-      show_help = true;
-    } else {
-      throw ArgParseException(std::string("invalid argument: ") + arg +
-                              " (run with --help for help)");
+  LogRecordRing() : records_(kCapacity) {}
+
+  // Before C++17, `new` only guarantees the alignment of std::max_align_t.
+  static void* operator new(std::size_t size) {
+#ifdef _WIN32
+    void* memory = _aligned_malloc(size, alignof(LogRecordRing));
+#else
+    void* memory = nullptr;
+    if (posix_memalign(&memory, alignof(LogRecordRing), size) != 0) {
+      memory = nullptr;
     }
+#endif
+    if (!memory) {
+      throw std::bad_alloc();
+    }
+    return memory;
   }
 
-  if (next_is_key) {
-    throw ArgParseException("expected argument after --key");
-  } else if (next_is_value) {
-    throw ArgParseException("expected argument after --value");
-  } else if (args.operations.size() == 0 && !show_help) {
-    throw ArgParseException("no arguments specified; run with --help for help");
+  static void operator delete(void* memory) {
+#ifdef _WIN32
+    _aligned_free(memory);
+#else
+    std::free(memory);
+#endif
   }
 
-  if (show_help) {
-    std::ostringstream ss;
-    ss << "Syntax: " << argv[0] << " [options] <read|write>..." << std::endl;
-    ss << std::endl;
-    ss << "The arguments \"read\" and \"write\" may be specified" << std::endl;
-    ss << "one or more times each, and each occurrence causes" << std::endl;
-    ss << "the application to perform a read or write operation" << std::endl;
-    ss << "from Firestore, respectively." << std::endl;
-    ss << std::endl;
-    ss << "The current directory *must* contain a" << std::endl;
-    ss << "google-services.json file." << std::endl;
-    ss << std::endl;
-    ss << "Options:" << std::endl;
-    ss << "  -h/--help" << std::endl;
-    ss << "    Print this help message and exit." << std::endl;
-    ss << "  -k/--key" << std::endl;
-    ss << "    Use this key when writing to Firestore." << std::endl;
-    ss << "  -v/--value" << std::endl;
-    ss << "    Use this value when writing to Firestore." << std::endl;
-    ss << "  -e/--emulator" << std::endl;
-    ss << "    Connection to the Firestore emulator." << std::endl;
-    ss << "  -d/--debug" << std::endl;
-    ss << "    Enable Firebase/Firestore debug logging." << std::endl;
-    ss << std::endl;
-    ss << "Examples:" << std::endl;
-    ss << std::endl;
-    ss << "Example 1: Perform a read followed by a write:" << std::endl;
-    ss << argv[0] << " read write" << std::endl;
-    ss << std::endl;
-    ss << "Example 2: Perform a write with custom key/value pair:" << std::endl;
-    ss << argv[0] << " -k city -v Dallas write" << std::endl;
-    ss << std::endl;
-    ss << "Example 3: Enable debug logging:" << std::endl;
-    ss << argv[0] << " --debug read write" << std::endl;
-    args.help_text = ss.str();
+  // Called only by the producing thread.
+  bool TryPush(std::chrono::steady_clock::time_point timestamp,
+               const char* message, std::size_t message_size) {
+    std::size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == kCapacity) {
+      return false;
+    }
+    Record& record = records_[tail & (kCapacity - 1)];
+    record.timestamp = timestamp;
+    // Once every slot's string has grown to fit the typical line, this copy no
+    // longer allocates.
+    record.message.assign(message, message_size);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
   }
 
-  return args;
-}
+  // Called only by the consuming thread.
+  bool TryPop(Record& record) {
+    std::size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    Record& slot = records_[head & (kCapacity - 1)];
+    record.timestamp = slot.timestamp;
+    record.message = slot.message;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
 
-std::string FirestoreErrorNameFromErrorCode(int error) {
-  switch (error) {
-    case Error::kErrorOk:
-      return "kErrorOk";
-    case Error::kErrorCancelled:
-      return "kErrorCancelled";
-    case Error::kErrorUnknown:
-      return "kErrorUnknown";
-    case Error::kErrorInvalidArgument:
-      return "kErrorInvalidArgument";
-    case Error::kErrorDeadlineExceeded:
-      return "kErrorDeadlineExceeded";
-    case Error::kErrorNotFound:
-      return "kErrorNotFound";
-    case Error::kErrorAlreadyExists:
-      return "kErrorAlreadyExists";
-    case Error::kErrorPermissionDenied:
-      return "kErrorPermissionDenied";
-    case Error::kErrorResourceExhausted:
-      return "kErrorResourceExhausted";
-    case Error::kErrorFailedPrecondition:
-      return "kErrorFailedPrecondition";
-    case Error::kErrorAborted:
-      return "kErrorAborted";
-    case Error::kErrorOutOfRange:
-      return "kErrorOutOfRange";
-    case Error::kErrorUnimplemented:
-      return "kErrorUnimplemented";
-    case Error::kErrorInternal:
-      return "kErrorInternal";
-    case Error::kErrorUnavailable:
-      return "kErrorUnavailable";
-    case Error::kErrorDataLoss:
-      return "kErrorDataLoss";
-    case Error::kErrorUnauthenticated:
-      return "kErrorUnauthenticated";
-    default:
-      return std::to_string(static_cast<int>(error));
+ private:
+  // Must be a power of two.
+  static constexpr std::size_t kCapacity = 4096;
+
+  std::vector<Record> records_;
+  // Aligned to keep the consumer's and the producer's index on separate cache
+  // lines.
+  alignas(64) std::atomic<std::size_t> head_{0};
+  alignas(64) std::atomic<std::size_t> tail_{0};
+};
+
+// Takes writing log output off the calling threads. While an instance exists,
+// `Log()` only captures a raw steady-clock timestamp and the formatted message
+// and pushes them into a ring owned by the calling thread; a background thread
+// drains every ring, orders the records by timestamp, converts the timestamps
+// to wall-clock time and writes them to stdout. Destroying the instance drains
+// all outstanding records before returning; `TryWrite()` fails once it has
+// begun, so that the caller writes its record directly instead.
+class AsyncLogWriter {
+ public:
+  AsyncLogWriter()
+      : system_clock_origin_(std::chrono::system_clock::now()),
+        steady_clock_origin_(std::chrono::steady_clock::now()),
+        writer_thread_([this]() { WriterThreadMain(); }) {
+    instance_.store(this, std::memory_order_release);
   }
-}
 
-void AwaitCompletion(FutureBase& future, const std::string& name) {
-  Log(name, " start");
-  auto start = std::chrono::steady_clock::now();
-  AwaitableFutureCompletion completion(future);
-  completion.AwaitInvoked();
-  auto end = std::chrono::steady_clock::now();
-  std::chrono::duration<double> elapsed_seconds = end - start;
+  ~AsyncLogWriter() {
+    // Writes that began before this finish pushing, the writer thread still
+    // emptying any full ring for them; later ones find no instance.
+    instance_.store(nullptr);
+    while (active_writes_.load() > 0) {
+      std::this_thread::yield();
+    }
+    running_.store(false, std::memory_order_release);
+    writer_thread_.join();
+    DrainRings();
+  }
 
-  std::string elapsed_time_str;
-  {
-    std::ostringstream ss;
-    ss << std::fixed;
-    ss << std::setprecision(2);
-    ss << elapsed_seconds.count() << "s";
-    elapsed_time_str = ss.str();
+  AsyncLogWriter(const AsyncLogWriter&) = delete;
+  AsyncLogWriter& operator=(const AsyncLogWriter&) = delete;
+
+  // Queues a record for the instance, if there is one and it is not being
+  // destroyed; returns whether it did.
+  static bool TryWrite(std::chrono::steady_clock::time_point timestamp,
+                       const char* message, std::size_t message_size) {
+    // Sequentially consistent, as are the destructor's accesses, so that
+    // either the destructor waits for this write or this write finds no
+    // instance.
+    active_writes_.fetch_add(1);
+    AsyncLogWriter* writer = instance_.load();
+    if (writer) {
+      LogRecordRing* ring = writer->RingForCurrentThread();
+      while (!ring->TryPush(timestamp, message, message_size)) {
+        // The ring is full; wait for the writer thread to catch up rather
+        // than dropping the record.
+        std::this_thread::yield();
+      }
+    }
+    active_writes_.fetch_sub(1, std::memory_order_release);
+    return writer != nullptr;
   }
 
-  if (future.error() != Error::kErrorOk) {
-    Log(name, " FAILED in ", elapsed_time_str, ": ",
-        FirestoreErrorNameFromErrorCode(future.error()), " ",
-        future.error_message());
-  } else {
-    Log(name, " done in ", elapsed_time_str);
+ private:
+  LogRecordRing* RingForCurrentThread() {
+    thread_local LogRecordRing* ring = nullptr;
+    thread_local AsyncLogWriter* ring_owner = nullptr;
+    if (ring_owner != this) {
+      std::unique_ptr<LogRecordRing> new_ring(new LogRecordRing);
+      ring = new_ring.get();
+      ring_owner = this;
+      std::lock_guard<std::mutex> lock(rings_mutex_);
+      rings_.push_back(std::move(new_ring));
+    }
+    return ring;
   }
-}
 
-void DoRead(DocumentReference doc) {
-  Log("=======================================");
-  Log("DoRead() doc=", doc.path());
-  Future<DocumentSnapshot> future = doc.Get(Source::kServer);
-  AwaitCompletion(future, "DocumentReference.Get()");
+  void WriterThreadMain() {
+    while (running_.load(std::memory_order_acquire)) {
+      if (!DrainRings()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+  }
 
-  const DocumentSnapshot* snapshot = future.result();
-  MapFieldValue data =
-      snapshot->GetData(DocumentSnapshot::ServerTimestampBehavior::kDefault);
-  Log("Document num key/value pairs: ", data.size());
-  int entry_index = 0;
-  for (const std::pair<std::string, FieldValue>& entry : data) {
-    Log("Entry #", ++entry_index, ": ", entry.first, "=", entry.second);
+  // Writes out every record currently queued; returns whether there were any.
+  bool DrainRings() {
+    std::vector<LogRecordRing::Record> records;
+    {
+      std::lock_guard<std::mutex> lock(rings_mutex_);
+      LogRecordRing::Record record;
+      for (const std::unique_ptr<LogRecordRing>& ring : rings_) {
+        while (ring->TryPop(record)) {
+          records.push_back(std::move(record));
+        }
+      }
+    }
+    if (records.empty()) {
+      return false;
+    }
+
+    std::stable_sort(records.begin(), records.end(),
+                     [](const LogRecordRing::Record& lhs,
+                        const LogRecordRing::Record& rhs) {
+                       return lhs.timestamp < rhs.timestamp;
+                     });
+    char timestamp[TimestampFormatter::kBufferSize];
+    for (const LogRecordRing::Record& record : records) {
+      auto wall_clock_timestamp =
+          system_clock_origin_ +
+          std::chrono::duration_cast<std::chrono::system_clock::duration>(
+              record.timestamp - steady_clock_origin_);
+      TimestampFormatter::Format(wall_clock_timestamp, timestamp);
+      std::cout << ">>>>> " << timestamp << " -- " << record.message << '\n';
+    }
+    std::cout.flush();
+    return true;
   }
-}
 
-void DoWrite(DocumentReference doc, const std::string& key,
-             const std::string& value) {
-  Log("=======================================");
-  Log("DoWrite() doc=", doc.path(), " setting ", key, "=", value);
-  MapFieldValue map;
-  map[key] = FieldValue::String(value);
-  Future<void> future = doc.Set(map);
-  AwaitCompletion(future, "DocumentReference.Set()");
+  static std::atomic<AsyncLogWriter*> instance_;
+  // The calls of TryWrite() that may be pushing into a ring of the instance.
+  static std::atomic<int> active_writes_;
+
+  const std::chrono::system_clock::time_point system_clock_origin_;
+  const std::chrono::steady_clock::time_point steady_clock_origin_;
+  std::atomic<bool> running_{true};
+  std::mutex rings_mutex_;
+  std::vector<std::unique_ptr<LogRecordRing>> rings_;
+  std::thread writer_thread_;
+};
+
+std::atomic<AsyncLogWriter*> AsyncLogWriter::instance_{nullptr};
+std::atomic<int> AsyncLogWriter::active_writes_{0};
+
+template <typename... T>
+void Log0(LogLineBuffer& line, T&&... messages) {
+  // Appends each message in order; the array exists only to expand the pack.
+  int expansion[] = {0, (line.Append(std::forward<T>(messages)), 0)...};
+  (void)expansion;
 }
 
-int main(int argc, char** argv) {
-  ParsedArguments args;
-  try {
-    args = ParseArguments(argc, argv);
-  } catch (ArgParseException& e) {
-    Log("ERROR: Invalid command-line arguments: ", e.what());
-    return 2;
+template <typename... T>
+void Log(T&&... messages) {
+  LogLineBuffer message;
+  auto steady_timestamp = std::chrono::steady_clock::now();
+  Log0(message, std::forward<T>(messages)...);
+  if (AsyncLogWriter::TryWrite(steady_timestamp, message.data(),
+                               message.size())) {
+    return;
   }
+  char timestamp[TimestampFormatter::kBufferSize];
+  std::size_t timestamp_size =
+      TimestampFormatter::Format(std::chrono::system_clock::now(), timestamp);
+  LogLineBuffer line;
+  line.Append(">>>>> ");
+  line.Append(timestamp, timestamp_size);
+  line.Append(" -- ");
+  line.Append(message.data(), message.size());
+  line.Append('\n');
+  std::cout.write(line.data(), line.size());
+  std::cout.flush();
+}
 
-  if (args.help_text.size() > 0) {
-    std::cout << args.help_text;
-    return 0;
+// Blocks the calling thread until one or more futures complete. Each instance
+// owns its completion state, registered through the user-data overload of
+// `OnCompletion()`, so a completing future wakes only the thread awaiting it.
+// The state is shared with the registered callbacks, so a caller may give up
+// waiting (e.g. when a deadline expires) and destroy the instance while the
+// futures are still pending.
+class AwaitableFutureCompletion {
+ public:
+  AwaitableFutureCompletion() : state_(std::make_shared<State>()) {}
+
+  explicit AwaitableFutureCompletion(const FutureBase& future)
+      : AwaitableFutureCompletion() {
+    Add(future);
   }
 
-  if (args.debug_logging_enabled) {
-    Log("Enabling debug logging");
-    SetLogLevel(LogLevel::kLogLevelDebug);
-    Firestore::set_log_level(LogLevel::kLogLevelDebug);
+  AwaitableFutureCompletion(const AwaitableFutureCompletion&) = delete;
+  AwaitableFutureCompletion& operator=(const AwaitableFutureCompletion&) =
+      delete;
+
+  // Also waits for `future`. Returns its index among the added futures, as
+  // reported by `completion_order()`.
+  int Add(const FutureBase& future) {
+    int index = added_count_++;
+    future.OnCompletion(OnCompletion, new Registration{state_, index});
+    return index;
   }
 
-  Log("Creating firebase::App");
-  std::unique_ptr<App> app(App::Create(AppOptions()));
-  if (!app) {
-    Log("ERROR: Creating firebase::App FAILED!");
-    return 1;
+  // Blocks until at least `count` added futures have completed.
+  void AwaitInvoked(std::size_t count = 1) {
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    state_->condition.wait(lock, [this, count]() {
+      return state_->completed.size() >= count;
+    });
   }
 
-  Log("Creating firebase::firestore::Firestore");
-  std::unique_ptr<Firestore> firestore(
-      Firestore::GetInstance(app.get(), nullptr));
-  if (!firestore) {
-    Log("ERROR: Creating firebase::firestore::Firestore FAILED!");
-    return 1;
+  // Blocks until at least `count` added futures have completed or `deadline`
+  // passes, whichever comes first; returns whether they completed.
+  bool AwaitInvokedUntil(std::size_t count,
+                         std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    return state_->condition.wait_until(lock, deadline, [this, count]() {
+      return state_->completed.size() >= count;
+    });
   }
 
-  if (args.use_emulator) {
-    Log("Using the Firestore Emulator");
-    Settings settings = firestore->settings();
-    settings.set_host("localhost:8080");
-    settings.set_ssl_enabled(false);
-    firestore->set_settings(settings);
+  // The indices of the futures that have completed, in completion order.
+  std::vector<int> completion_order() const {
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    return state_->completed;
   }
 
-  DocumentReference doc = firestore->Document("UnityIssue1154TestApp/TestDoc");
-  Log("Performing ", args.operations.size(),
-      " operations on document: ", doc.path());
-  for (Operation operation : args.operations) {
-    switch (operation) {
-      case Operation::kRead: {
-        DoRead(doc);
-        break;
-      }
-      case Operation::kWrite: {
-        std::string key = args.key_valid ? args.key : "TestKey";
-        std::string value = args.value_valid ? args.value : "TestValue";
-        DoWrite(doc, key, value);
-        break;
-      }
-      default: {
-        Log("INTERNAL ERROR: unknown value for operation: ",
-            static_cast<int>(operation));
-        return 1;
-      }
-    }
+  // When each of the futures in `completion_order()` completed.
+  std::vector<std::chrono::steady_clock::time_point> completion_times() const {
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    return state_->completion_times;
   }
 
+ private:
+  struct State {
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::vector<int> completed;
+    std::vector<std::chrono::steady_clock::time_point> completion_times;
+  };
+
+  struct Registration {
+    std::shared_ptr<State> state;
+    int index;
+  };
+
+  static void OnCompletion(const FutureBase&, void* user_data) {
+    auto now = std::chrono::steady_clock::now();
+    std::unique_ptr<Registration> registration(
+        static_cast<Registration*>(user_data));
+    State& state = *registration->state;
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.completed.push_back(registration->index);
+    state.completion_times.push_back(now);
+    state.condition.notify_one();
+  }
+
+  std::shared_ptr<State> state_;
+  int added_count_ = 0;
+};
+
+// The --threads worker that the calling thread works for, numbered from 1; 0
+// for the main thread. Trace events are grouped into one track per worker.
+int& CurrentWorker() {
+  thread_local int worker = 0;
+  return worker;
+}
+
+// A fixed pool of threads that runs posted tasks, either as soon as a thread
+// is free or once a delay has passed. It runs the continuations of `Async`
+// values, so that any number of chains of operations share a few threads
+// instead of each blocking one. Its threads work for the same worker as the
+// thread that created it. Destroying it waits for every posted task,
+// including delayed ones and any they post in turn.
+class Executor {
+ public:
+  explicit Executor(int thread_count) {
+    int worker = CurrentWorker();
+    for (int i = 0; i < thread_count; i++) {
+      threads_.emplace_back([this, worker]() {
+        CurrentWorker() = worker;
+        RunTasks();
+      });
+    }
+  }
+
+  Executor(const Executor&) = delete;
+  Executor& operator=(const Executor&) = delete;
+
+  ~Executor() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      shutting_down_ = true;
+    }
+    condition_.notify_all();
+    for (std::thread& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  void Post(std::function<void()> task) {
+    PostAt(std::chrono::steady_clock::now(), std::move(task));
+  }
+
+  void PostAfter(std::chrono::steady_clock::duration delay,
+                 std::function<void()> task) {
+    PostAt(std::chrono::steady_clock::now() + delay, std::move(task));
+  }
+
+  int thread_count() const { return static_cast<int>(threads_.size()); }
+
+ private:
+  struct Task {
+    std::chrono::steady_clock::time_point due;
+    // Keeps tasks that are due at the same time in the order they were posted.
+    uint64_t sequence;
+    std::function<void()> run;
+  };
+
+  struct RunsLater {
+    bool operator()(const Task& a, const Task& b) const {
+      return a.due != b.due ? a.due > b.due : a.sequence > b.sequence;
+    }
+  };
+
+  void PostAt(std::chrono::steady_clock::time_point due,
+              std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.push(Task{due, next_sequence_++, std::move(task)});
+    }
+    condition_.notify_one();
+  }
+
+  void RunTasks() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      if (tasks_.empty()) {
+        if (shutting_down_) {
+          return;
+        }
+        condition_.wait(lock);
+        continue;
+      }
+      auto due = tasks_.top().due;
+      if (due > std::chrono::steady_clock::now()) {
+        condition_.wait_until(lock, due);
+        continue;
+      }
+      std::function<void()> task = tasks_.top().run;
+      tasks_.pop();
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::priority_queue<Task, std::vector<Task>, RunsLater> tasks_;
+  uint64_t next_sequence_ = 0;
+  bool shutting_down_ = false;
+  std::vector<std::thread> threads_;
+};
+
+// The eventual result of an asynchronous computation. Callbacks registered
+// with `OnComplete()` and continuations chained with `Then()` run on the
+// executor once the result is available, never on the thread that produced
+// it. Copies share the same result.
+template <typename T>
+class Async {
+ public:
+  explicit Async(Executor& executor)
+      : state_(std::make_shared<State>(executor)) {}
+
+  static Async Completed(Executor& executor, T value) {
+    Async async(executor);
+    async.Complete(std::move(value));
+    return async;
+  }
+
+  // Makes `value` the result and schedules the registered callbacks. Must be
+  // called exactly once.
+  void Complete(T value) const {
+    std::vector<std::function<void(const T&)>> callbacks;
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      state_->value = std::move(value);
+      state_->completed = true;
+      callbacks.swap(state_->callbacks);
+    }
+    state_->condition.notify_all();
+    for (auto& callback : callbacks) {
+      Schedule(std::move(callback));
+    }
+  }
+
+  void OnComplete(std::function<void(const T&)> callback) const {
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      if (!state_->completed) {
+        state_->callbacks.push_back(std::move(callback));
+        return;
+      }
+    }
+    Schedule(std::move(callback));
+  }
+
+  // Runs `continuation` with the result once it is available; the returned
+  // value completes with the result of the `Async` that `continuation`
+  // returns, so that dependent steps (e.g. read, transform, write) compose
+  // without blocking a thread.
+  template <typename U>
+  Async<U> Then(std::function<Async<U>(const T&)> continuation) const {
+    Async<U> result(state_->executor);
+    OnComplete([continuation, result](const T& value) {
+      continuation(value).OnComplete(
+          [result](const U& next) { result.Complete(next); });
+    });
+    return result;
+  }
+
+  // Blocks until the result is available. Must not be called from an executor
+  // thread, whose continuations might be the ones producing it.
+  T Wait() const {
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    state_->condition.wait(lock, [this]() { return state_->completed; });
+    return state_->value;
+  }
+
+  Executor& executor() const { return state_->executor; }
+
+ private:
+  struct State {
+    explicit State(Executor& executor) : executor(executor) {}
+
+    Executor& executor;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool completed = false;
+    // Immutable once `completed` is set.
+    T value;
+    std::vector<std::function<void(const T&)>> callbacks;
+  };
+
+  void Schedule(std::function<void(const T&)> callback) const {
+    std::shared_ptr<State> state = state_;
+    state->executor.Post([state, callback]() { callback(state->value); });
+  }
+
+  std::shared_ptr<State> state_;
+};
+
+// A completed future and when its completion callback ran, which excludes the
+// time its continuations spend queued on the executor.
+template <typename T>
+struct CompletedFuture {
+  Future<T> future;
+  std::chrono::steady_clock::time_point time;
+};
+
+// An `Async` that completes once `future` does, registered through the
+// user-data overload of `OnCompletion()` like `AwaitableFutureCompletion`.
+template <typename T>
+Async<CompletedFuture<T>> AsyncFromFuture(Executor& executor,
+                                          const Future<T>& future) {
+  struct Registration {
+    Async<CompletedFuture<T>> async;
+    Future<T> future;
+
+    static void OnCompletion(const FutureBase&, void* user_data) {
+      auto now = std::chrono::steady_clock::now();
+      std::unique_ptr<Registration> registration(
+          static_cast<Registration*>(user_data));
+      registration->async.Complete(
+          CompletedFuture<T>{registration->future, now});
+    }
+  };
+
+  Async<CompletedFuture<T>> async(executor);
+  static_cast<const FutureBase&>(future).OnCompletion(
+      Registration::OnCompletion, new Registration{async, future});
+  return async;
+}
+
+// An `Async` that completes with the results of all of `asyncs`, in order,
+// once the last of them completes.
+template <typename T>
+Async<std::vector<T>> WhenAll(Executor& executor,
+                              const std::vector<Async<T>>& asyncs) {
+  struct State {
+    std::mutex mutex;
+    std::vector<T> values;
+    std::size_t remaining;
+  };
+
+  Async<std::vector<T>> result(executor);
+  if (asyncs.empty()) {
+    result.Complete(std::vector<T>());
+    return result;
+  }
+  auto state = std::make_shared<State>();
+  state->values.resize(asyncs.size());
+  state->remaining = asyncs.size();
+  for (std::size_t i = 0; i < asyncs.size(); i++) {
+    asyncs[i].OnComplete([state, result, i](const T& value) {
+      std::unique_lock<std::mutex> lock(state->mutex);
+      state->values[i] = value;
+      if (--state->remaining == 0) {
+        lock.unlock();
+        result.Complete(std::move(state->values));
+      }
+    });
+  }
+  return result;
+}
+
+// An `Async` that completes with the index of whichever of `asyncs`, which
+// must not be empty, completes first.
+template <typename T>
+Async<std::size_t> WhenAny(Executor& executor,
+                           const std::vector<Async<T>>& asyncs) {
+  Async<std::size_t> result(executor);
+  auto completed = std::make_shared<std::atomic<bool>>(false);
+  for (std::size_t i = 0; i < asyncs.size(); i++) {
+    asyncs[i].OnComplete([completed, result, i](const T&) {
+      if (!completed->exchange(true)) {
+        result.Complete(i);
+      }
+    });
+  }
+  return result;
+}
+
+class ArgParseException : public std::exception {
+ public:
+  ArgParseException(const std::string& what) : what_(what) {}
+
+  const char* what() const noexcept override { return what_.c_str(); }
+
+ private:
+  const std::string what_;
+};
+
+// The operations to perform, parsed from a compact specification such as
+// "write*100 (read,write)*1000 sleep:50ms": terms separated by whitespace or
+// commas, each an operation name, a "sleep:<duration>" pause, or a
+// parenthesized group, optionally repeated with "*<count>". The terms are
+// stored flattened in preorder, each group followed by its members, and are
+// expanded lazily by WorkloadIterator, so memory use is proportional to the
+// length of the specification rather than to the number of operations.
+class WorkloadSpec {
+ public:
+  struct Term {
+    enum class Kind {
+      kOperation,
+      kSleep,
+      kGroup,
+    };
+    Kind kind = Kind::kOperation;
+    Operation operation = Operation::kRead;
+    std::chrono::steady_clock::duration sleep =
+        std::chrono::steady_clock::duration::zero();
+    uint64_t repeat = 1;
+    // For kGroup, the index one past the group's last member.
+    std::size_t end = 0;
+  };
+
+  // Parses `text`; throws ArgParseException if it is malformed.
+  static WorkloadSpec Parse(const std::string& text) {
+    WorkloadSpec spec;
+    std::size_t position = 0;
+    spec.ParseSequence(text, position);
+    if (position < text.size()) {
+      throw ArgParseException("invalid workload: unexpected '" +
+                              std::string(1, text[position]) +
+                              "' at position " + std::to_string(position + 1));
+    }
+    return spec;
+  }
+
+  bool empty() const { return terms_.empty(); }
+  const std::vector<Term>& terms() const { return terms_; }
+
+  // The total number of operations that the workload expands to.
+  uint64_t operation_count() const { return OperationCount(0, terms_.size()); }
+
+  bool Contains(Operation operation) const {
+    for (const Term& term : terms_) {
+      if (term.kind == Term::Kind::kOperation && term.operation == operation) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  static bool IsSeparator(char c) {
+    return c == ',' || std::isspace(static_cast<unsigned char>(c));
+  }
+
+  static void SkipSeparators(const std::string& text, std::size_t& position) {
+    while (position < text.size() && IsSeparator(text[position])) {
+      position++;
+    }
+  }
+
+  static std::string ReadWord(const std::string& text, std::size_t& position) {
+    std::size_t start = position;
+    while (position < text.size() && !IsSeparator(text[position]) &&
+           text[position] != '(' && text[position] != ')' &&
+           text[position] != '*') {
+      position++;
+    }
+    return text.substr(start, position - start);
+  }
+
+  static std::chrono::steady_clock::duration ParseSleep(
+      const std::string& duration) {
+    char* unit = nullptr;
+    double value = std::strtod(duration.c_str(), &unit);
+    double seconds_per_unit = 0;
+    if (unit == std::string("s")) {
+      seconds_per_unit = 1;
+    } else if (unit == std::string("ms")) {
+      seconds_per_unit = 1e-3;
+    } else if (unit == std::string("us")) {
+      seconds_per_unit = 1e-6;
+    }
+    if (unit == duration.c_str() || seconds_per_unit == 0 || !(value >= 0)) {
+      throw ArgParseException("invalid workload: invalid sleep duration: " +
+                              duration + " (must be e.g. 50ms, 2s or 100us)");
+    }
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(value * seconds_per_unit));
+  }
+
+  // Parses terms up to the end of `text` or a closing parenthesis.
+  void ParseSequence(const std::string& text, std::size_t& position) {
+    while (true) {
+      SkipSeparators(text, position);
+      if (position == text.size() || text[position] == ')') {
+        return;
+      }
+      ParseTerm(text, position);
+    }
+  }
+
+  void ParseTerm(const std::string& text, std::size_t& position) {
+    std::size_t term_index = terms_.size();
+    terms_.emplace_back();
+    if (text[position] == '(') {
+      std::size_t open_position = position++;
+      ParseSequence(text, position);
+      if (position == text.size()) {
+        throw ArgParseException(
+            "invalid workload: unmatched '(' at position " +
+            std::to_string(open_position + 1));
+      } else if (terms_.size() == term_index + 1) {
+        throw ArgParseException("invalid workload: empty group at position " +
+                                std::to_string(open_position + 1));
+      }
+      position++;
+      terms_[term_index].kind = Term::Kind::kGroup;
+      terms_[term_index].end = terms_.size();
+    } else {
+      std::string word = ReadWord(text, position);
+      Term& term = terms_[term_index];
+      if (word == "read") {
+        term.operation = Operation::kRead;
+      } else if (word == "write") {
+        term.operation = Operation::kWrite;
+      } else if (word == "listen") {
+        term.operation = Operation::kListen;
+      } else if (word == "txn") {
+        term.operation = Operation::kTransaction;
+      } else if (word == "increment") {
+        term.operation = Operation::kIncrement;
+      } else if (word == "query") {
+        term.operation = Operation::kQuery;
+      } else if (word == "fanout") {
+        term.operation = Operation::kFanOut;
+      } else if (word == "drain") {
+        term.operation = Operation::kDrain;
+      } else if (word.compare(0, 6, "sleep:") == 0) {
+        term.kind = Term::Kind::kSleep;
+        term.sleep = ParseSleep(word.substr(6));
+      } else {
+        throw ArgParseException("invalid workload term: " + word +
+                                " (run with --help for help)");
+      }
+    }
+
+    if (position < text.size() && text[position] == '*') {
+      position++;
+      std::string count = ReadWord(text, position);
+      std::size_t parsed_length = 0;
+      unsigned long long repeat = 0;
+      try {
+        repeat = std::stoull(count, &parsed_length);
+      } catch (std::logic_error&) {
+        parsed_length = 0;
+      }
+      if (count.empty() || parsed_length != count.size() || repeat < 1) {
+        throw ArgParseException("invalid workload: invalid repeat count: " +
+                                count + " (must be a positive integer)");
+      }
+      terms_[term_index].repeat = repeat;
+    }
+  }
+
+  uint64_t OperationCount(std::size_t begin, std::size_t end) const {
+    uint64_t count = 0;
+    for (std::size_t i = begin; i < end;) {
+      const Term& term = terms_[i];
+      if (term.kind == Term::Kind::kGroup) {
+        count += term.repeat * OperationCount(i + 1, term.end);
+        i = term.end;
+      } else {
+        if (term.kind == Term::Kind::kOperation) {
+          count += term.repeat;
+        }
+        i++;
+      }
+    }
+    return count;
+  }
+
+  std::vector<Term> terms_;
+};
+
+// One step of an expanded workload: an operation, or a pause.
+struct WorkloadStep {
+  bool is_sleep = false;
+  Operation operation = Operation::kRead;
+  std::chrono::steady_clock::duration sleep =
+      std::chrono::steady_clock::duration::zero();
+};
+
+// Streams the steps of a WorkloadSpec in order, keeping only one frame per
+// level of group nesting.
+class WorkloadIterator {
+ public:
+  explicit WorkloadIterator(const WorkloadSpec& spec) : terms_(spec.terms()) {
+    if (!terms_.empty()) {
+      frames_.push_back(Frame{0, terms_.size(), 0, 1, 0});
+    }
+  }
+
+  // Stores the next step in `step`, or returns false if there are none left.
+  bool Next(WorkloadStep& step) {
+    if (!Peek(step)) {
+      return false;
+    }
+    has_peeked_ = false;
+    return true;
+  }
+
+  // Like Next(), but the step is returned again by the following call.
+  bool Peek(WorkloadStep& step) {
+    if (!has_peeked_) {
+      has_peeked_ = Advance(peeked_);
+    }
+    step = peeked_;
+    return has_peeked_;
+  }
+
+ private:
+  struct Frame {
+    std::size_t begin;
+    std::size_t end;
+    std::size_t position;
+    // The number of passes over the group left, including the current one.
+    uint64_t passes_left;
+    // The number of repetitions of the term at `position` left.
+    uint64_t repeats_left;
+  };
+
+  bool Advance(WorkloadStep& step) {
+    while (!frames_.empty()) {
+      Frame& frame = frames_.back();
+      if (frame.position == frame.end) {
+        if (--frame.passes_left > 0) {
+          frame.position = frame.begin;
+        } else {
+          frames_.pop_back();
+        }
+        continue;
+      }
+
+      const WorkloadSpec::Term& term = terms_[frame.position];
+      if (term.kind == WorkloadSpec::Term::Kind::kGroup) {
+        std::size_t begin = frame.position + 1;
+        frame.position = term.end;
+        frames_.push_back(Frame{begin, term.end, begin, term.repeat, 0});
+        continue;
+      }
+      if (frame.repeats_left == 0) {
+        frame.repeats_left = term.repeat;
+      }
+      if (--frame.repeats_left == 0) {
+        frame.position++;
+      }
+      step.is_sleep = term.kind == WorkloadSpec::Term::Kind::kSleep;
+      step.operation = term.operation;
+      step.sleep = term.sleep;
+      return true;
+    }
+    return false;
+  }
+
+  const std::vector<WorkloadSpec::Term>& terms_;
+  std::vector<Frame> frames_;
+  WorkloadStep peeked_;
+  bool has_peeked_ = false;
+};
+
+enum class KeyDistribution {
+  kUniform,
+  kZipf,
+};
+
+enum class ThreadTopology {
+  // All worker threads share the one Firestore instance.
+  kShared,
+  // Each worker thread has its own named App and Firestore instance.
+  kPerThread,
+};
+
+enum class ReadMode {
+  kServer,
+  kCache,
+  kDefault,
+  // Try the local cache first and fall back to the server on a miss.
+  kMixed,
+};
+
+// The Source for reads in `mode`. kMixed maps to Source::kDefault for the
+// callback-driven --concurrency pipeline and load generator, which issue a
+// single Get() per read; sequential reads perform the cache-then-server
+// fallback themselves.
+Source SourceForReadMode(ReadMode mode) {
+  switch (mode) {
+    case ReadMode::kServer:
+      return Source::kServer;
+    case ReadMode::kCache:
+      return Source::kCache;
+    case ReadMode::kDefault:
+    case ReadMode::kMixed:
+      return Source::kDefault;
+  }
+  return Source::kServer;
+}
+
+enum class HedgeMode {
+  kNone,
+  // Issue a second server read.
+  kServer,
+  // Fall back to a read from the local cache.
+  kCache,
+};
+
+std::string FirestoreErrorNameFromErrorCode(int error) {
+  switch (error) {
+    case Error::kErrorOk:
+      return "kErrorOk";
+    case Error::kErrorCancelled:
+      return "kErrorCancelled";
+    case Error::kErrorUnknown:
+      return "kErrorUnknown";
+    case Error::kErrorInvalidArgument:
+      return "kErrorInvalidArgument";
+    case Error::kErrorDeadlineExceeded:
+      return "kErrorDeadlineExceeded";
+    case Error::kErrorNotFound:
+      return "kErrorNotFound";
+    case Error::kErrorAlreadyExists:
+      return "kErrorAlreadyExists";
+    case Error::kErrorPermissionDenied:
+      return "kErrorPermissionDenied";
+    case Error::kErrorResourceExhausted:
+      return "kErrorResourceExhausted";
+    case Error::kErrorFailedPrecondition:
+      return "kErrorFailedPrecondition";
+    case Error::kErrorAborted:
+      return "kErrorAborted";
+    case Error::kErrorOutOfRange:
+      return "kErrorOutOfRange";
+    case Error::kErrorUnimplemented:
+      return "kErrorUnimplemented";
+    case Error::kErrorInternal:
+      return "kErrorInternal";
+    case Error::kErrorUnavailable:
+      return "kErrorUnavailable";
+    case Error::kErrorDataLoss:
+      return "kErrorDataLoss";
+    case Error::kErrorUnauthenticated:
+      return "kErrorUnauthenticated";
+    default:
+      return std::to_string(static_cast<int>(error));
+  }
+}
+
+// The Error whose FirestoreErrorNameFromErrorCode() is `name`, if any.
+bool ErrorCodeFromName(const std::string& name, Error& error) {
+  for (int code = Error::kErrorOk; code <= Error::kErrorUnauthenticated;
+       code++) {
+    if (FirestoreErrorNameFromErrorCode(code) == name) {
+      error = static_cast<Error>(code);
+      return true;
+    }
+  }
+  return false;
+}
+
+// When and how often the sequential operations retry a failed attempt.
+struct RetryPolicy {
+  // 1 means failed attempts are not retried.
+  int max_attempts = 1;
+  // The upper bound of the first backoff; each subsequent bound is
+  // `multiplier` times the last, up to `max_backoff`. The actual delay is
+  // chosen uniformly at random below the bound ("full jitter").
+  std::chrono::steady_clock::duration initial_backoff =
+      std::chrono::milliseconds(100);
+  std::chrono::steady_clock::duration max_backoff = std::chrono::seconds(10);
+  double multiplier = 2;
+  std::vector<Error> retryable_errors = {Error::kErrorDeadlineExceeded,
+                                         Error::kErrorUnavailable};
+
+  bool IsRetryable(Error error) const {
+    return std::find(retryable_errors.begin(), retryable_errors.end(),
+                     error) != retryable_errors.end();
+  }
+};
+
+// How the sequential DoRead()/DoWrite()/DoBatchWrite() wait for operations.
+struct RequestPolicy {
+  ReadMode read_mode = ReadMode::kServer;
+  // Give up waiting for an operation after this long; zero means never.
+  std::chrono::steady_clock::duration deadline =
+      std::chrono::steady_clock::duration::zero();
+  // Whether to hedge reads that are slower than the steady-state p95.
+  HedgeMode hedge = HedgeMode::kNone;
+  RetryPolicy retry;
+  // The fields that reads extract, each with DocumentSnapshot::Get(); empty
+  // means the whole document with DocumentSnapshot::GetData().
+  std::vector<std::string> fields;
+  // The number of documents that kTransaction and kIncrement operations
+  // spread their increments over, chosen uniformly at random.
+  int hot_documents = 1;
+  // The documents per kQuery page, and the most pages each one reads; zero
+  // means the whole collection.
+  int page_size = 100;
+  int max_pages = 0;
+};
+
+enum class ResultsFormat {
+  kJsonLines,
+  kCsv,
+};
+
+struct LoadGeneratorOptions {
+  // Zero means the load generator is disabled.
+  double ops_per_second = 0;
+  double duration_seconds = 10;
+  double read_fraction = 0.5;
+  int keyspace_size = 1;
+  KeyDistribution distribution = KeyDistribution::kUniform;
+  double zipf_exponent = 0.99;
+};
+
+enum class PayloadValueType {
+  kString,
+  kBlob,
+  // Rotates between strings, blobs and integers.
+  kMixed,
+};
+
+enum class ValueSizeDistribution {
+  kUniform,
+  // Uniform in log space: mostly small values with a long tail of large ones.
+  kLogUniform,
+};
+
+// The maximum size of a Firestore document.
+constexpr int64_t kMaxDocumentBytes = 1024 * 1024;
+
+struct PayloadOptions {
+  // The number of generated fields per document; zero means writes set the
+  // single --key/--value field instead.
+  int field_count = 0;
+  int min_value_bytes = 16;
+  int max_value_bytes = 16;
+  ValueSizeDistribution size_distribution = ValueSizeDistribution::kUniform;
+  PayloadValueType value_type = PayloadValueType::kString;
+  // The number of alternating map and array levels around each field value.
+  int nesting_depth = 0;
+
+  // The size of the largest document that can be generated, as Firestore
+  // counts it: every value at the maximum size, plus a byte for each string,
+  // plus the field names, the "value" keys of the maps nesting each value and
+  // the document's name and fixed overhead.
+  int64_t MaxDocumentBytes() const {
+    int64_t size = kDocumentOverheadBytes;
+    for (int i = 0; i < field_count; i++) {
+      size += 5 + std::to_string(i).size() + 1;
+      // Every third value of a mixed document is an 8-byte integer.
+      size += value_type == PayloadValueType::kMixed && i % 3 == 2
+                  ? 8
+                  : max_value_bytes + 1;
+      size += (nesting_depth + 1) / 2 * 6;
+    }
+    return size;
+  }
+
+  // Firestore's 32 bytes per document, plus a generous allowance for its name.
+  static constexpr int64_t kDocumentOverheadBytes = 32 + 128;
+};
+
+// The conditions that the proxy in front of the emulator imposes on every
+// connection through it. Loss is emulated as the TCP retransmission it would
+// cause, since dropping bytes from a stream would corrupt it instead.
+struct NetworkConditions {
+  // The delay before each connection reaches the emulator.
+  double connect_delay_seconds = 0;
+  // The one-way delay added to every chunk of data in each direction.
+  double latency_seconds = 0;
+  // The cap on each direction of each connection; zero means none.
+  double bandwidth_bytes_per_second = 0;
+  // The fraction of chunks delayed by a retransmission timeout.
+  double loss = 0;
+
+  bool enabled() const {
+    return connect_delay_seconds > 0 || latency_seconds > 0 ||
+           bandwidth_bytes_per_second > 0 || loss > 0;
+  }
+};
+
+struct ParsedArguments {
+  WorkloadSpec workload;
+  std::string key;
+  bool key_valid = false;
+  std::string value;
+  bool value_valid = false;
+  int concurrency = 1;
+  // With --chains, the number of chains and the threads they share.
+  int chains = 0;
+  int executor_threads = 2;
+  int batch_size = 1;
+  int threads = 1;
+  // The number of snapshot listeners attached by each kListen operation.
+  int listeners = 1;
+  // The number of documents written by each kFanOut operation.
+  int fanout = 4;
+  // The number of writes queued by each kDrain operation.
+  int offline_writes = 100;
+  // The number of Firestore instances, each of its own named App, that the
+  // load generator routes operations across.
+  int shards = 1;
+  ThreadTopology topology = ThreadTopology::kShared;
+  bool warmup = false;
+  RequestPolicy request_policy;
+  LoadGeneratorOptions load;
+  PayloadOptions payload;
+  bool use_emulator = false;
+  // The host that --emulator connects to; replaced with the proxy's own
+  // address while `network` imposes any conditions.
+  std::string emulator_host = "localhost:8080";
+  NetworkConditions network;
+  // The trace to write with --record, and to replay with --replay.
+  std::string record_file;
+  std::string replay_file;
+  double replay_speed = 1;
+  // Where to write the startup profile; empty means it is only logged.
+  std::string startup_profile_file;
+  // How often to sample resource usage; zero means never. Samples are only
+  // summarized unless `samples_file` is set.
+  double sample_interval_seconds = 0;
+  std::string samples_file;
+  // Where to write the Chrome trace_event timeline, if anywhere.
+  std::string chrome_trace_file;
+  // Overrides for the corresponding Firestore Settings, if set.
+  bool persistence_enabled = true;
+  bool persistence_enabled_valid = false;
+  int64_t cache_size_bytes = 0;
+  bool cache_size_bytes_valid = false;
+  bool debug_logging_enabled = false;
+  bool async_logging = false;
+  ResultsFormat results_format = ResultsFormat::kJsonLines;
+  bool results_format_valid = false;
+  std::string results_file = "-";
+  TimestampFormatter::Precision timestamp_precision =
+      TimestampFormatter::Precision::kMilliseconds;
+  std::string help_text;
+};
+
+int ParsePositiveInt(const std::string& option, const std::string& arg) {
+  std::size_t parsed_length = 0;
+  int value = 0;
+  try {
+    value = std::stoi(arg, &parsed_length);
+  } catch (std::logic_error&) {
+    parsed_length = 0;
+  }
+  if (parsed_length != arg.size() || value < 1) {
+    throw ArgParseException(std::string("invalid value for ") + option +
+                            ": " + arg + " (must be a positive integer)");
+  }
+  return value;
+}
+
+int64_t ParsePositiveInt64(const std::string& option, const std::string& arg) {
+  std::size_t parsed_length = 0;
+  long long value = 0;
+  try {
+    value = std::stoll(arg, &parsed_length);
+  } catch (std::logic_error&) {
+    parsed_length = 0;
+  }
+  if (parsed_length != arg.size() || value < 1) {
+    throw ArgParseException(std::string("invalid value for ") + option +
+                            ": " + arg + " (must be a positive integer)");
+  }
+  return value;
+}
+
+double ParseDouble(const std::string& option, const std::string& arg,
+                   const std::string& requirement) {
+  std::size_t parsed_length = 0;
+  double value = 0;
+  try {
+    value = std::stod(arg, &parsed_length);
+  } catch (std::logic_error&) {
+    parsed_length = 0;
+  }
+  if (parsed_length != arg.size() || !std::isfinite(value)) {
+    throw ArgParseException(std::string("invalid value for ") + option +
+                            ": " + arg + " (" + requirement + ")");
+  }
+  return value;
+}
+
+double ParsePositiveDouble(const std::string& option, const std::string& arg) {
+  const std::string requirement = "must be a positive number";
+  double value = ParseDouble(option, arg, requirement);
+  if (value <= 0) {
+    throw ArgParseException(std::string("invalid value for ") + option +
+                            ": " + arg + " (" + requirement + ")");
+  }
+  return value;
+}
+
+double ParseFraction(const std::string& option, const std::string& arg) {
+  const std::string requirement = "must be a number between 0 and 1";
+  double value = ParseDouble(option, arg, requirement);
+  if (value < 0 || value > 1) {
+    throw ArgParseException(std::string("invalid value for ") + option +
+                            ": " + arg + " (" + requirement + ")");
+  }
+  return value;
+}
+
+ParsedArguments ParseArguments(int argc, char** argv) {
+  ParsedArguments args;
+  // The long name of an option whose value is expected in the next argument.
+  std::string pending_option;
+  bool show_help = false;
+  std::string workload_text;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    if (pending_option == "--key") {
+      args.key = arg;
+      args.key_valid = true;
+      pending_option.clear();
+    } else if (pending_option == "--value") {
+      args.value = arg;
+      args.value_valid = true;
+      pending_option.clear();
+    } else if (pending_option == "--concurrency") {
+      args.concurrency = ParsePositiveInt(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--chains") {
+      args.chains = ParsePositiveInt(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--page-size") {
+      args.request_policy.page_size = ParsePositiveInt(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--max-pages") {
+      args.request_policy.max_pages = ParsePositiveInt(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--hot-docs") {
+      args.request_policy.hot_documents =
+          ParsePositiveInt(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--executor-threads") {
+      args.executor_threads = ParsePositiveInt(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--batch-size") {
+      args.batch_size = ParsePositiveInt(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--threads") {
+      args.threads = ParsePositiveInt(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--topology") {
+      if (arg == "shared") {
+        args.topology = ThreadTopology::kShared;
+      } else if (arg == "per-thread") {
+        args.topology = ThreadTopology::kPerThread;
+      } else {
+        throw ArgParseException(std::string("invalid value for ") +
+                                pending_option + ": " + arg +
+                                " (must be \"shared\" or \"per-thread\")");
+      }
+      pending_option.clear();
+    } else if (pending_option == "--deadline") {
+      args.request_policy.deadline =
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              std::chrono::duration<double>(
+                  ParsePositiveDouble(pending_option, arg)));
+      pending_option.clear();
+    } else if (pending_option == "--source") {
+      if (arg == "server") {
+        args.request_policy.read_mode = ReadMode::kServer;
+      } else if (arg == "cache") {
+        args.request_policy.read_mode = ReadMode::kCache;
+      } else if (arg == "default") {
+        args.request_policy.read_mode = ReadMode::kDefault;
+      } else if (arg == "mixed") {
+        args.request_policy.read_mode = ReadMode::kMixed;
+      } else {
+        throw ArgParseException(
+            std::string("invalid value for ") + pending_option + ": " + arg +
+            " (must be \"server\", \"cache\", \"default\" or \"mixed\")");
+      }
+      pending_option.clear();
+    } else if (pending_option == "--persistence") {
+      if (arg == "on" || arg == "off") {
+        args.persistence_enabled = arg == "on";
+        args.persistence_enabled_valid = true;
+      } else {
+        throw ArgParseException(std::string("invalid value for ") +
+                                pending_option + ": " + arg +
+                                " (must be \"on\" or \"off\")");
+      }
+      pending_option.clear();
+    } else if (pending_option == "--cache-size-bytes") {
+      if (arg == "unlimited") {
+        args.cache_size_bytes = Settings::kCacheSizeUnlimited;
+      } else {
+        args.cache_size_bytes = ParsePositiveInt64(pending_option, arg);
+      }
+      args.cache_size_bytes_valid = true;
+      pending_option.clear();
+    } else if (pending_option == "--max-attempts") {
+      args.request_policy.retry.max_attempts =
+          ParsePositiveInt(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--retry-backoff") {
+      args.request_policy.retry.initial_backoff =
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              std::chrono::duration<double>(
+                  ParsePositiveDouble(pending_option, arg)));
+      pending_option.clear();
+    } else if (pending_option == "--retry-max-backoff") {
+      args.request_policy.retry.max_backoff =
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              std::chrono::duration<double>(
+                  ParsePositiveDouble(pending_option, arg)));
+      pending_option.clear();
+    } else if (pending_option == "--retry-on") {
+      std::vector<Error>& errors = args.request_policy.retry.retryable_errors;
+      errors.clear();
+      std::istringstream names(arg);
+      std::string name;
+      while (std::getline(names, name, ',')) {
+        Error error = Error::kErrorOk;
+        if (!ErrorCodeFromName(name, error) || error == Error::kErrorOk) {
+          throw ArgParseException(
+              std::string("invalid value for ") + pending_option + ": " +
+              arg + " (must be a comma-separated list of error names, " +
+              "e.g. kErrorUnavailable)");
+        }
+        errors.push_back(error);
+      }
+      pending_option.clear();
+    } else if (pending_option == "--hedge") {
+      if (arg == "server") {
+        args.request_policy.hedge = HedgeMode::kServer;
+      } else if (arg == "cache") {
+        args.request_policy.hedge = HedgeMode::kCache;
+      } else {
+        throw ArgParseException(std::string("invalid value for ") +
+                                pending_option + ": " + arg +
+                                " (must be \"server\" or \"cache\")");
+      }
+      pending_option.clear();
+    } else if (pending_option == "--rate") {
+      args.load.ops_per_second = ParsePositiveDouble(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--duration") {
+      args.load.duration_seconds = ParsePositiveDouble(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--read-fraction") {
+      args.load.read_fraction = ParseFraction(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--keyspace") {
+      args.load.keyspace_size = ParsePositiveInt(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--distribution") {
+      if (arg == "uniform") {
+        args.load.distribution = KeyDistribution::kUniform;
+      } else if (arg == "zipf") {
+        args.load.distribution = KeyDistribution::kZipf;
+      } else {
+        throw ArgParseException(std::string("invalid value for ") +
+                                pending_option + ": " + arg +
+                                " (must be \"uniform\" or \"zipf\")");
+      }
+      pending_option.clear();
+    } else if (pending_option == "--timestamp-precision") {
+      if (arg == "ms") {
+        args.timestamp_precision = TimestampFormatter::Precision::kMilliseconds;
+      } else if (arg == "us") {
+        args.timestamp_precision = TimestampFormatter::Precision::kMicroseconds;
+      } else {
+        throw ArgParseException(std::string("invalid value for ") +
+                                pending_option + ": " + arg +
+                                " (must be \"ms\" or \"us\")");
+      }
+      pending_option.clear();
+    } else if (pending_option == "--output-format") {
+      if (arg == "jsonl") {
+        args.results_format = ResultsFormat::kJsonLines;
+      } else if (arg == "csv") {
+        args.results_format = ResultsFormat::kCsv;
+      } else {
+        throw ArgParseException(std::string("invalid value for ") +
+                                pending_option + ": " + arg +
+                                " (must be \"jsonl\" or \"csv\")");
+      }
+      args.results_format_valid = true;
+      pending_option.clear();
+    } else if (pending_option == "--output-file") {
+      args.results_file = arg;
+      args.results_format_valid = true;
+      pending_option.clear();
+    } else if (pending_option == "--sample-interval") {
+      args.sample_interval_seconds = ParsePositiveDouble(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--samples-file") {
+      args.samples_file = arg;
+      pending_option.clear();
+    } else if (pending_option == "--chrome-trace") {
+      args.chrome_trace_file = arg;
+      pending_option.clear();
+    } else if (pending_option == "--record") {
+      args.record_file = arg;
+      pending_option.clear();
+    } else if (pending_option == "--replay") {
+      args.replay_file = arg;
+      pending_option.clear();
+    } else if (pending_option == "--speed") {
+      args.replay_speed = ParsePositiveDouble(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--startup-profile") {
+      args.startup_profile_file = arg;
+      pending_option.clear();
+    } else if (pending_option == "--fields") {
+      args.request_policy.fields.clear();
+      std::istringstream fields(arg);
+      std::string field;
+      while (std::getline(fields, field, ',')) {
+        if (field.empty()) {
+          throw ArgParseException(
+              std::string("invalid value for ") + pending_option + ": " + arg +
+              " (must be a comma-separated list of fields)");
+        }
+        args.request_policy.fields.push_back(field);
+      }
+      pending_option.clear();
+    } else if (pending_option == "--payload-fields") {
+      args.payload.field_count = ParsePositiveInt(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--payload-value-bytes") {
+      std::size_t separator = arg.find('-');
+      args.payload.min_value_bytes =
+          ParsePositiveInt(pending_option, arg.substr(0, separator));
+      args.payload.max_value_bytes =
+          separator == std::string::npos
+              ? args.payload.min_value_bytes
+              : ParsePositiveInt(pending_option, arg.substr(separator + 1));
+      if (args.payload.max_value_bytes < args.payload.min_value_bytes) {
+        throw ArgParseException(std::string("invalid value for ") +
+                                pending_option + ": " + arg +
+                                " (maximum must not be less than minimum)");
+      }
+      pending_option.clear();
+    } else if (pending_option == "--payload-size-distribution") {
+      if (arg == "uniform") {
+        args.payload.size_distribution = ValueSizeDistribution::kUniform;
+      } else if (arg == "log-uniform") {
+        args.payload.size_distribution = ValueSizeDistribution::kLogUniform;
+      } else {
+        throw ArgParseException(std::string("invalid value for ") +
+                                pending_option + ": " + arg +
+                                " (must be \"uniform\" or \"log-uniform\")");
+      }
+      pending_option.clear();
+    } else if (pending_option == "--payload-type") {
+      if (arg == "string") {
+        args.payload.value_type = PayloadValueType::kString;
+      } else if (arg == "blob") {
+        args.payload.value_type = PayloadValueType::kBlob;
+      } else if (arg == "mixed") {
+        args.payload.value_type = PayloadValueType::kMixed;
+      } else {
+        throw ArgParseException(
+            std::string("invalid value for ") + pending_option + ": " + arg +
+            " (must be \"string\", \"blob\" or \"mixed\")");
+      }
+      pending_option.clear();
+    } else if (pending_option == "--payload-nesting") {
+      args.payload.nesting_depth = ParsePositiveInt(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--shards") {
+      args.shards = ParsePositiveInt(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--offline-writes") {
+      args.offline_writes = ParsePositiveInt(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--fanout") {
+      args.fanout = ParsePositiveInt(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--listeners") {
+      args.listeners = ParsePositiveInt(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--proxy-connect-delay") {
+      args.network.connect_delay_seconds =
+          ParsePositiveDouble(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--proxy-latency") {
+      args.network.latency_seconds = ParsePositiveDouble(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--proxy-bandwidth") {
+      args.network.bandwidth_bytes_per_second =
+          ParsePositiveDouble(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--proxy-loss") {
+      args.network.loss = ParseFraction(pending_option, arg);
+      pending_option.clear();
+    } else if (pending_option == "--zipf-exponent") {
+      args.load.zipf_exponent = ParsePositiveDouble(pending_option, arg);
+      pending_option.clear();
+    } else if (arg == "-k" || arg == "--key") {
+      pending_option = "--key";
+    } else if (arg == "-v" || arg == "--value") {
+      pending_option = "--value";
+    } else if (arg == "-c" || arg == "--concurrency") {
+      pending_option = "--concurrency";
+    } else if (arg == "-b" || arg == "--batch-size") {
+      pending_option = "--batch-size";
+    } else if (arg == "-t" || arg == "--threads") {
+      pending_option = "--threads";
+    } else if (arg == "--topology" || arg == "--deadline" || arg == "--hedge" ||
+               arg == "--source" || arg == "--persistence" ||
+               arg == "--chains" || arg == "--executor-threads" ||
+               arg == "--hot-docs" || arg == "--page-size" ||
+               arg == "--max-pages" ||
+               arg == "--cache-size-bytes" || arg == "--listeners" ||
+               arg == "--fanout" || arg == "--shards" ||
+               arg == "--offline-writes" ||
+               arg == "--proxy-connect-delay" || arg == "--proxy-latency" ||
+               arg == "--proxy-bandwidth" || arg == "--proxy-loss" ||
+               arg == "--fields" || arg == "--startup-profile" ||
+               arg == "--record" || arg == "--replay" || arg == "--speed" ||
+               arg == "--max-attempts" || arg == "--retry-backoff" ||
+               arg == "--retry-max-backoff" || arg == "--retry-on" ||
+               arg == "--payload-fields" ||
+               arg == "--payload-value-bytes" ||
+               arg == "--payload-size-distribution" ||
+               arg == "--payload-type" || arg == "--payload-nesting") {
+      pending_option = arg;
+    } else if (arg == "-w" || arg == "--warmup") {
+      args.warmup = true;
+    } else if (arg == "--rate" || arg == "--duration" ||
+               arg == "--read-fraction" || arg == "--keyspace" ||
+               arg == "--distribution" || arg == "--zipf-exponent") {
+      pending_option = arg;
+    } else if (arg == "-e" || arg == "--emulator") {
+      args.use_emulator = true;
+    } else if (arg == "-d" || arg == "--debug") {
+      args.debug_logging_enabled = true;
+    } else if (arg == "--async-logging") {
+      args.async_logging = true;
+    } else if (arg == "--timestamp-precision" || arg == "--output-format" ||
+               arg == "--output-file" || arg == "--sample-interval" ||
+               arg == "--samples-file" || arg == "--chrome-trace") {
+      pending_option = arg;
+    } else if (arg == "-h" || arg == "--help") {
+      show_help = true;
+    } else if (!arg.empty() && arg[0] != '-') {
+      workload_text += arg;
+      workload_text += ' ';
+    } else {
+      throw ArgParseException(std::string("invalid argument: ") + arg +
+                              " (run with --help for help)");
+    }
+  }
+
+  if (!pending_option.empty()) {
+    throw ArgParseException("expected argument after " + pending_option);
+  }
+  args.workload = WorkloadSpec::Parse(workload_text);
+  // The pipeline, the chains and the load generator issue each operation
+  // once and await it without a client-side deadline.
+  const bool awaits_asynchronously = args.concurrency > 1 || args.chains > 0 ||
+                                     args.load.ops_per_second > 0 ||
+                                     !args.replay_file.empty();
+  if (args.load.ops_per_second > 0 && !args.workload.empty()) {
+    throw ArgParseException(
+        "read/write operations cannot be combined with --rate");
+  } else if (!args.replay_file.empty() &&
+             (args.load.ops_per_second > 0 || !args.workload.empty())) {
+    throw ArgParseException(
+        "--replay cannot be combined with --rate or read/write operations");
+  } else if (args.shards > 1 && args.load.ops_per_second == 0 &&
+             args.replay_file.empty()) {
+    throw ArgParseException("--shards requires --rate or --replay");
+  } else if (args.shards > 1 && args.topology == ThreadTopology::kPerThread) {
+    throw ArgParseException(
+        "--shards cannot be combined with --topology per-thread");
+  } else if (args.network.enabled() && !args.use_emulator) {
+    throw ArgParseException("--proxy-* options require --emulator");
+  } else if (args.payload.MaxDocumentBytes() > kMaxDocumentBytes) {
+    throw ArgParseException(
+        "generated documents could reach " +
+        std::to_string(args.payload.MaxDocumentBytes()) +
+        " bytes, over Firestore's limit of " +
+        std::to_string(kMaxDocumentBytes) +
+        " (reduce --payload-fields or --payload-value-bytes)");
+  } else if (args.request_policy.hedge != HedgeMode::kNone &&
+             args.request_policy.retry.max_attempts > 1) {
+    throw ArgParseException("--hedge cannot be combined with --max-attempts");
+  } else if (awaits_asynchronously &&
+             (args.request_policy.deadline >
+                  std::chrono::steady_clock::duration::zero() ||
+              args.request_policy.hedge != HedgeMode::kNone)) {
+    throw ArgParseException(
+        "--deadline and --hedge cannot be combined with --concurrency, "
+        "--chains, --rate or --replay");
+  } else if (awaits_asynchronously &&
+             args.request_policy.retry.max_attempts > 1) {
+    throw ArgParseException(
+        "--max-attempts cannot be combined with --concurrency, --chains, "
+        "--rate or --replay");
+  } else if (args.concurrency > 1 && args.chains > 0) {
+    throw ArgParseException("--concurrency cannot be combined with --chains");
+  } else if ((args.concurrency > 1 || args.chains > 0) &&
+             (args.workload.Contains(Operation::kListen) ||
+              args.workload.Contains(Operation::kQuery) ||
+              args.workload.Contains(Operation::kFanOut) ||
+              args.workload.Contains(Operation::kDrain))) {
+    throw ArgParseException(
+        "listen, query, fanout and drain operations cannot be combined with "
+        "--concurrency or --chains");
+  } else if (!args.record_file.empty() &&
+             args.workload.Contains(Operation::kDrain)) {
+    throw ArgParseException(
+        "drain operations cannot be combined with --record");
+  } else if (args.threads > 1 && args.topology == ThreadTopology::kShared &&
+             args.workload.Contains(Operation::kDrain)) {
+    throw ArgParseException(
+        "drain operations cannot be combined with --threads unless "
+        "--topology is per-thread");
+  } else if (args.workload.empty() && args.load.ops_per_second == 0 &&
+             args.replay_file.empty() &&
+             !show_help) {
+    throw ArgParseException("no arguments specified; run with --help for help");
+  }
+
+  if (show_help) {
+    std::ostringstream ss;
+    ss << "Syntax: " << argv[0] << " [options] <workload>..." << std::endl;
+    ss << "        " << argv[0] << " [options] --rate <ops/sec>" << std::endl;
+    ss << "        " << argv[0] << " [options] --replay <file>" << std::endl;
+    ss << std::endl;
+    ss << "The arguments \"read\" and \"write\" may be specified" << std::endl;
+    ss << "one or more times each, and each occurrence causes" << std::endl;
+    ss << "the application to perform a read or write operation" << std::endl;
+    ss << "from Firestore, respectively. Each \"listen\" writes" << std::endl;
+    ss << "a unique value from a separate thread and measures" << std::endl;
+    ss << "how long the snapshot listeners take to observe it." << std::endl;
+    ss << "Each \"txn\" increments a counter in a hot document" << std::endl;
+    ss << "in a read-modify-write transaction, and each" << std::endl;
+    ss << "\"increment\" does the same with a single write of" << std::endl;
+    ss << "FieldValue::Increment() for comparison." << std::endl;
+    ss << "Each \"query\" reads the whole collection a page at" << std::endl;
+    ss << "a time, continuing after the last document of the" << std::endl;
+    ss << "previous page." << std::endl;
+    ss << "Each \"fanout\" writes --fanout documents at once and" << std::endl;
+    ss << "waits for all of them, recording the latency of each" << std::endl;
+    ss << "document and of the slowest." << std::endl;
+    ss << "Each \"drain\" disables the network, queues" << std::endl;
+    ss << "--offline-writes writes locally and re-enables it," << std::endl;
+    ss << "measuring how long the queue takes to drain." << std::endl;
+    ss << std::endl;
+    ss << "Operations may be repeated with \"*<count>\" and" << std::endl;
+    ss << "grouped with parentheses, and \"sleep:<duration>\"" << std::endl;
+    ss << "(e.g. 50ms, 2s, 100us) pauses between operations;" << std::endl;
+    ss << "the workload is expanded as it runs." << std::endl;
+    ss << std::endl;
+    ss << "The current directory *must* contain a" << std::endl;
+    ss << "google-services.json file." << std::endl;
+    ss << std::endl;
+    ss << "Options:" << std::endl;
+    ss << "  -h/--help" << std::endl;
+    ss << "    Print this help message and exit." << std::endl;
+    ss << "  -k/--key" << std::endl;
+    ss << "    Use this key when writing to Firestore." << std::endl;
+    ss << "  -v/--value" << std::endl;
+    ss << "    Use this value when writing to Firestore." << std::endl;
+    ss << "  -c/--concurrency <N>" << std::endl;
+    ss << "    Keep up to N operations in flight at once, issuing" << std::endl;
+    ss << "    the next operation as soon as one completes" << std::endl;
+    ss << "    (default: 1, one operation at a time)." << std::endl;
+    ss << "  --chains <N>" << std::endl;
+    ss << "    Run N copies of the workload at once, each as a" << std::endl;
+    ss << "    chain of continuations that issues an operation" << std::endl;
+    ss << "    when its previous one completes." << std::endl;
+    ss << "  --executor-threads <T>" << std::endl;
+    ss << "    The threads that run the continuations of all" << std::endl;
+    ss << "    --chains (default: 2)." << std::endl;
+    ss << "  -b/--batch-size <K>" << std::endl;
+    ss << "    Commit up to K consecutive write operations" << std::endl;
+    ss << "    together in a single WriteBatch (default: 1, no" << std::endl;
+    ss << "    batching)." << std::endl;
+    ss << "  -t/--threads <T>" << std::endl;
+    ss << "    Run the whole workload on each of T worker threads" << std::endl;
+    ss << "    at the same time (default: 1)." << std::endl;
+    ss << "  --topology <shared|per-thread>" << std::endl;
+    ss << "    With --threads, whether the workers share one" << std::endl;
+    ss << "    Firestore instance or each create their own named" << std::endl;
+    ss << "    App and Firestore instance (default: shared)." << std::endl;
+    ss << "  --shards <K>" << std::endl;
+    ss << "    With --rate or --replay, create K named App and" << std::endl;
+    ss << "    Firestore instances and route each operation to" << std::endl;
+    ss << "    one by a hash of its document path (default: 1)." << std::endl;
+    ss << "  --payload-fields <N>" << std::endl;
+    ss << "    Write generated documents of N fields instead of" << std::endl;
+    ss << "    the single --key/--value field." << std::endl;
+    ss << "  --payload-value-bytes <min>[-<max>]" << std::endl;
+    ss << "    The size of each generated value (default: 16)." << std::endl;
+    ss << "  --payload-size-distribution <uniform|log-uniform>" << std::endl;
+    ss << "    How generated value sizes are distributed between" << std::endl;
+    ss << "    min and max (default: uniform)." << std::endl;
+    ss << "  --payload-type <string|blob|mixed>" << std::endl;
+    ss << "    The type of generated values (default: string);" << std::endl;
+    ss << "    \"mixed\" rotates strings, blobs and integers." << std::endl;
+    ss << "  --payload-nesting <D>" << std::endl;
+    ss << "    Nest each generated value D levels deep in" << std::endl;
+    ss << "    alternating maps and arrays." << std::endl;
+    ss << "  --fanout <N>" << std::endl;
+    ss << "    Write N documents for each fanout operation" << std::endl;
+    ss << "    (default: 4)." << std::endl;
+    ss << "  --offline-writes <N>" << std::endl;
+    ss << "    Queue N writes for each drain operation" << std::endl;
+    ss << "    (default: 100)." << std::endl;
+    ss << "  --listeners <N>" << std::endl;
+    ss << "    Attach N snapshot listeners to the document for" << std::endl;
+    ss << "    each listen operation (default: 1)." << std::endl;
+    ss << "  --hot-docs <N>" << std::endl;
+    ss << "    Spread txn and increment operations over N" << std::endl;
+    ss << "    documents at random (default: 1)." << std::endl;
+    ss << "  --page-size <N>" << std::endl;
+    ss << "    The documents per query page (default: 100)." << std::endl;
+    ss << "  --max-pages <N>" << std::endl;
+    ss << "    Stop each query after N pages (default: read the" << std::endl;
+    ss << "    whole collection)." << std::endl;
+    ss << "  --source <server|cache|default|mixed>" << std::endl;
+    ss << "    Where reads get their data (default: server);" << std::endl;
+    ss << "    \"mixed\" tries the local cache first and falls" << std::endl;
+    ss << "    back to the server on a miss." << std::endl;
+    ss << "  --fields <field>[,<field>...]" << std::endl;
+    ss << "    Only extract these fields from documents that are" << std::endl;
+    ss << "    read, instead of the whole document." << std::endl;
+    ss << "  --persistence <on|off>" << std::endl;
+    ss << "    Enable or disable Firestore offline persistence." << std::endl;
+    ss << "  --cache-size-bytes <N|unlimited>" << std::endl;
+    ss << "    Set the Firestore local cache size threshold." << std::endl;
+    ss << "  --deadline <seconds>" << std::endl;
+    ss << "    Stop waiting for a read or write after this long" << std::endl;
+    ss << "    and count it as kErrorDeadlineExceeded. Not" << std::endl;
+    ss << "    with --concurrency, --chains, --rate or --replay." << std::endl;
+    ss << "  --max-attempts <N>" << std::endl;
+    ss << "    Retry a read or write that fails with a retryable" << std::endl;
+    ss << "    error, up to N attempts in total (default: 1)." << std::endl;
+    ss << "    Not with --concurrency, --chains, --rate or" << std::endl;
+    ss << "    --replay." << std::endl;
+    ss << "  --retry-backoff <seconds>" << std::endl;
+    ss << "    The bound of the first retry's jittered backoff;" << std::endl;
+    ss << "    it doubles after each retry (default: 0.1)." << std::endl;
+    ss << "  --retry-max-backoff <seconds>" << std::endl;
+    ss << "    The largest backoff bound (default: 10)." << std::endl;
+    ss << "  --retry-on <error>[,<error>...]" << std::endl;
+    ss << "    The retryable errors (default:" << std::endl;
+    ss << "    kErrorDeadlineExceeded,kErrorUnavailable)." << std::endl;
+    ss << "  --hedge <server|cache>" << std::endl;
+    ss << "    If a read is slower than the steady-state p95 read" << std::endl;
+    ss << "    latency so far, issue a second server read or a" << std::endl;
+    ss << "    cache read and use whichever succeeds first. Not" << std::endl;
+    ss << "    with --concurrency, --chains, --rate or --replay." << std::endl;
+    ss << "  -w/--warmup" << std::endl;
+    ss << "    Establish the backend connection with a write to a" << std::endl;
+    ss << "    scratch document before the first operation, and" << std::endl;
+    ss << "    report its timing separately." << std::endl;
+    ss << std::endl;
+    ss << "Load generator options:" << std::endl;
+    ss << "  --rate <ops/sec>" << std::endl;
+    ss << "    Instead of the listed operations, issue reads and" << std::endl;
+    ss << "    writes open-loop at this rate, on schedule and" << std::endl;
+    ss << "    regardless of how many are still in flight." << std::endl;
+    ss << "  --duration <seconds>" << std::endl;
+    ss << "    How long to generate load for (default: 10)." << std::endl;
+    ss << "  --read-fraction <0..1>" << std::endl;
+    ss << "    Fraction of operations that are reads" << std::endl;
+    ss << "    (default: 0.5)." << std::endl;
+    ss << "  --keyspace <M>" << std::endl;
+    ss << "    Spread operations over M documents (default: 1)." << std::endl;
+    ss << "  --distribution <uniform|zipf>" << std::endl;
+    ss << "    How documents are chosen (default: uniform)." << std::endl;
+    ss << "  --zipf-exponent <s>" << std::endl;
+    ss << "    Skew of the zipf distribution (default: 0.99)." << std::endl;
+    ss << "  --record <file>" << std::endl;
+    ss << "    Record every issued operation, with its document," << std::endl;
+    ss << "    payload and issue time, to this trace file." << std::endl;
+    ss << "    Cannot be combined with \"drain\", whose offline" << std::endl;
+    ss << "    writes would replay as online ones." << std::endl;
+    ss << "  --replay <file>" << std::endl;
+    ss << "    Instead of the listed operations, replay a trace" << std::endl;
+    ss << "    open-loop with its recorded inter-arrival times." << std::endl;
+    ss << "  --speed <x>" << std::endl;
+    ss << "    Replay x times faster than recorded (default: 1)." << std::endl;
+    ss << std::endl;
+    ss << "  -e/--emulator" << std::endl;
+    ss << "    Connection to the Firestore emulator." << std::endl;
+    ss << "  --proxy-connect-delay <seconds>" << std::endl;
+    ss << "  --proxy-latency <seconds>" << std::endl;
+    ss << "  --proxy-bandwidth <bytes/sec>" << std::endl;
+    ss << "  --proxy-loss <fraction>" << std::endl;
+    ss << "    With --emulator, connect through a local proxy" << std::endl;
+    ss << "    that delays each new connection, adds one-way" << std::endl;
+    ss << "    latency in each direction, caps bandwidth, or" << std::endl;
+    ss << "    delays the given fraction of chunks by a TCP" << std::endl;
+    ss << "    retransmission timeout, respectively." << std::endl;
+    ss << "  --startup-profile <file>" << std::endl;
+    ss << "    Profile startup through the first RPCs and write" << std::endl;
+    ss << "    the phase timings to this file as JSON (\"-\" for" << std::endl;
+    ss << "    stdout), for diffing across runs and SDK versions." << std::endl;
+    ss << "  -d/--debug" << std::endl;
+    ss << "    Enable Firebase/Firestore debug logging." << std::endl;
+    ss << "  --async-logging" << std::endl;
+    ss << "    Hand log lines to a background writer thread" << std::endl;
+    ss << "    instead of writing them to stdout on the calling" << std::endl;
+    ss << "    thread." << std::endl;
+    ss << "  --timestamp-precision <ms|us>" << std::endl;
+    ss << "    Show log timestamps to the millisecond or the" << std::endl;
+    ss << "    microsecond (default: ms)." << std::endl;
+    ss << "  --output-format <jsonl|csv>" << std::endl;
+    ss << "    Write one machine-readable record per completed" << std::endl;
+    ss << "    operation, as JSON lines or CSV (default: jsonl)." << std::endl;
+    ss << "  --output-file <path>" << std::endl;
+    ss << "    Where to write the records; implies" << std::endl;
+    ss << "    --output-format (default: \"-\", meaning stdout)." << std::endl;
+    ss << "  --sample-interval <seconds>" << std::endl;
+    ss << "    Sample the RSS, CPU time, context switches and" << std::endl;
+    ss << "    thread count of the process at this interval and" << std::endl;
+    ss << "    summarize them at the end." << std::endl;
+    ss << "  --samples-file <path>" << std::endl;
+    ss << "    Also write each sample to this file (\"-\" for" << std::endl;
+    ss << "    stdout) in the --output-format, timestamped like" << std::endl;
+    ss << "    the operation records." << std::endl;
+    ss << "  --chrome-trace <path>" << std::endl;
+    ss << "    Write the startup phases, warm-up, operations and" << std::endl;
+    ss << "    resource samples as a Chrome trace_event JSON" << std::endl;
+    ss << "    timeline with a track per worker thread, for" << std::endl;
+    ss << "    chrome://tracing or Perfetto (\"-\" for stdout)." << std::endl;
+    ss << std::endl;
+    ss << "Examples:" << std::endl;
+    ss << std::endl;
+    ss << "Example 1: Perform a read followed by a write:" << std::endl;
+    ss << argv[0] << " read write" << std::endl;
+    ss << std::endl;
+    ss << "Example 2: Perform a write with custom key/value pair:" << std::endl;
+    ss << argv[0] << " -k city -v Dallas write" << std::endl;
+    ss << std::endl;
+    ss << "Example 3: Enable debug logging:" << std::endl;
+    ss << argv[0] << " --debug read write" << std::endl;
+    ss << std::endl;
+    ss << "Example 4: Perform 6 reads with up to 3 in flight:" << std::endl;
+    ss << argv[0] << " -c 3 read read read read read read" << std::endl;
+    ss << std::endl;
+    ss << "Example 5: Connect up front, then perform a read:" << std::endl;
+    ss << argv[0] << " --warmup read" << std::endl;
+    ss << std::endl;
+    ss << "Example 6: Commit 4 writes in a single batch:" << std::endl;
+    ss << argv[0] << " -b 4 write write write write" << std::endl;
+    ss << std::endl;
+    ss << "Example 7: Hedge reads with the cache, 5s deadline:" << std::endl;
+    ss << argv[0] << " --hedge cache --deadline 5 read read read" << std::endl;
+    ss << std::endl;
+    ss << "Example 8: 4 threads, each with its own Firestore:" << std::endl;
+    ss << argv[0] << " -t 4 --topology per-thread read write" << std::endl;
+    ss << std::endl;
+    ss << "Example 9: 200 ops/sec for 30s, 90% reads, over 1000" << std::endl;
+    ss << "zipf-distributed documents:" << std::endl;
+    ss << argv[0] << " --rate 200 --duration 30 --read-fraction 0.9 \\"
+       << std::endl;
+    ss << "    --keyspace 1000 --distribution zipf" << std::endl;
+    ss << std::endl;
+    ss << "Example 10: Measure the cache hit rate of reads:" << std::endl;
+    ss << argv[0] << " --source mixed write read read read" << std::endl;
+    ss << std::endl;
+    ss << "Example 11: Write documents of 50 fields of 1-16KiB:" << std::endl;
+    ss << argv[0] << " --payload-fields 50 \\" << std::endl;
+    ss << "    --payload-value-bytes 1024-16384 \\" << std::endl;
+    ss << "    --payload-size-distribution log-uniform write" << std::endl;
+    ss << std::endl;
+    ss << "Example 12: 100 writes, then 1000 read/write pairs" << std::endl;
+    ss << "pausing 50ms after each pair:" << std::endl;
+    ss << argv[0] << " 'write*100 (read,write,sleep:50ms)*1000'" << std::endl;
+    ss << std::endl;
+    ss << "Example 13: 1000 chains of read/write pairs on 4" << std::endl;
+    ss << "threads:" << std::endl;
+    ss << argv[0] << " --chains 1000 --executor-threads 4 \\" << std::endl;
+    ss << "    '(read,write)*10'" << std::endl;
+    ss << std::endl;
+    ss << "Example 14: Transactions vs. increments on 5 hot" << std::endl;
+    ss << "documents from 8 threads:" << std::endl;
+    ss << argv[0] << " -t 8 --hot-docs 5 'txn*100 increment*100'"
+       << std::endl;
+    ss << std::endl;
+    ss << "Example 15: Time an export of the collection in" << std::endl;
+    ss << "pages of 500 documents:" << std::endl;
+    ss << argv[0] << " --page-size 500 query" << std::endl;
+    ss << std::endl;
+    ss << "Example 16: Check whether throughput scales with" << std::endl;
+    ss << "the number of Firestore instances:" << std::endl;
+    ss << argv[0] << " --shards 4 --rate 2000 --duration 30 --keyspace 1000"
+       << std::endl;
+    ss << std::endl;
+    ss << "Example 17: Reproduce a 20-second first connection" << std::endl;
+    ss << "with the emulator:" << std::endl;
+    ss << argv[0] << " -e --proxy-connect-delay 20 read write read"
+       << std::endl;
+    ss << std::endl;
+    ss << "Example 18: Time the drain of 1000 writes queued" << std::endl;
+    ss << "while offline:" << std::endl;
+    ss << argv[0] << " --offline-writes 1000 drain" << std::endl;
+    args.help_text = ss.str();
+  }
+
+  return args;
+}
+
+// A log-bucketed latency histogram in the style of HdrHistogram. Values below
+// `kSubBucketCount` nanoseconds are recorded exactly; above that, each
+// power-of-two range is split into `kSubBucketCount` linear sub-buckets, which
+// bounds the relative error of any reported value to 1/kSubBucketCount (~3%)
+// while covering the full 64-bit nanosecond range in under 2,000 counters.
+class LatencyHistogram {
+ public:
+  LatencyHistogram() : counts_(kNumBuckets, 0) {}
+
+  void Record(std::chrono::nanoseconds latency) {
+    uint64_t value = latency.count() < 0 ? 0 : latency.count();
+    counts_[BucketIndex(value)]++;
+    if (total_count_ == 0 || value < min_) {
+      min_ = value;
+    }
+    if (value > max_) {
+      max_ = value;
+    }
+    total_count_++;
+  }
+
+  uint64_t count() const { return total_count_; }
+  uint64_t min() const { return min_; }
+  uint64_t max() const { return max_; }
+
+  // Returns the highest value, in nanoseconds, that is equivalent (within the
+  // histogram's precision) to the value at the given percentile.
+  uint64_t ValueAtPercentile(double percentile) const {
+    if (total_count_ == 0) {
+      return 0;
+    }
+    uint64_t target = static_cast<uint64_t>(
+        std::ceil(percentile / 100.0 * static_cast<double>(total_count_)));
+    if (target < 1) {
+      target = 1;
+    } else if (target > total_count_) {
+      target = total_count_;
+    }
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < counts_.size(); i++) {
+      seen += counts_[i];
+      if (seen >= target) {
+        uint64_t upper_bound = BucketUpperBound(i);
+        return upper_bound < max_ ? upper_bound : max_;
+      }
+    }
+    return max_;
+  }
+
+ private:
+  static constexpr int kSubBucketBits = 5;
+  static constexpr uint64_t kSubBucketCount = 1ULL << kSubBucketBits;
+  static constexpr std::size_t kNumBuckets =
+      (64 - kSubBucketBits + 1) * kSubBucketCount;
+
+  static int HighestBit(uint64_t value) {
+    int bit = 0;
+    while (value >>= 1) {
+      bit++;
+    }
+    return bit;
+  }
+
+  static std::size_t BucketIndex(uint64_t value) {
+    if (value < kSubBucketCount) {
+      return static_cast<std::size_t>(value);
+    }
+    int shift = HighestBit(value) - kSubBucketBits;
+    uint64_t sub_bucket = (value >> shift) - kSubBucketCount;
+    return static_cast<std::size_t>((shift + 1) * kSubBucketCount +
+                                    sub_bucket);
+  }
+
+  static uint64_t BucketUpperBound(std::size_t index) {
+    if (index < kSubBucketCount) {
+      return index;
+    }
+    int shift = static_cast<int>(index / kSubBucketCount) - 1;
+    uint64_t sub_bucket = index % kSubBucketCount + kSubBucketCount;
+    return ((sub_bucket + 1) << shift) - 1;
+  }
+
+  std::vector<uint64_t> counts_;
+  uint64_t total_count_ = 0;
+  uint64_t min_ = 0;
+  uint64_t max_ = 0;
+};
+
+enum class LatencyPhase {
+  kFirstOperation,
+  kSteadyState,
+};
+
+LatencyPhase LatencyPhaseForOperationIndex(std::size_t index) {
+  return index == 0 ? LatencyPhase::kFirstOperation
+                    : LatencyPhase::kSteadyState;
+}
+
+// Heap allocations made by one thread, counted by the replacement global
+// `operator new` below so that the cost of extracting read results can be
+// attributed to the thread that performed the extraction.
+struct AllocationCounts {
+  uint64_t count = 0;
+  uint64_t bytes = 0;
+
+  static AllocationCounts CurrentThread() {
+    AllocationCounts counts;
+    counts.count = current_thread_count_;
+    counts.bytes = current_thread_bytes_;
+    return counts;
+  }
+
+  AllocationCounts operator-(const AllocationCounts& other) const {
+    AllocationCounts counts;
+    counts.count = count - other.count;
+    counts.bytes = bytes - other.bytes;
+    return counts;
+  }
+
+  static void RecordAllocation(std::size_t size) {
+    current_thread_count_++;
+    current_thread_bytes_ += size;
+  }
+
+ private:
+  static thread_local uint64_t current_thread_count_;
+  static thread_local uint64_t current_thread_bytes_;
+};
+
+thread_local uint64_t AllocationCounts::current_thread_count_ = 0;
+thread_local uint64_t AllocationCounts::current_thread_bytes_ = 0;
+
+void* operator new(std::size_t size) {
+  AllocationCounts::RecordAllocation(size);
+  void* ptr = std::malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+
+// Where the data returned by a read came from.
+enum class DataOrigin {
+  // Not a read, or the read failed.
+  kNone,
+  kCache,
+  kServer,
+};
+
+std::string DataOriginName(DataOrigin origin) {
+  switch (origin) {
+    case DataOrigin::kNone:
+      return "none";
+    case DataOrigin::kCache:
+      return "cache";
+    case DataOrigin::kServer:
+      return "server";
+  }
+  return std::to_string(static_cast<int>(origin));
+}
+
+// The outcome of one completed operation.
+struct OperationRecord {
+  Operation operation = Operation::kRead;
+  // The position of the operation in the run, starting at 0.
+  uint64_t index = 0;
+  std::string doc_path;
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point end;
+  int error = Error::kErrorOk;
+  // The approximate number of bytes of document data read or written.
+  std::size_t payload_bytes = 0;
+  // The number of writes committed by a kBatchWrite operation, otherwise 1.
+  int item_count = 1;
+  DataOrigin origin = DataOrigin::kNone;
+  // Whether the contents of a successful read were extracted, and the heap
+  // allocations that made, which with --fields can be none at all.
+  bool result_extracted = false;
+  AllocationCounts result_allocations;
+  // The number of attempts made, and when the first of them completed.
+  int attempts = 1;
+  std::chrono::steady_clock::time_point first_attempt_end;
+  // The number of times a kTransaction ran its update function, which the SDK
+  // repeats when a document it read changes before the commit; otherwise 0.
+  int transaction_attempts = 0;
+  // The page of a kQuery, starting at 0; only the first page of the first
+  // operation pays for establishing the backend connection.
+  int page = 0;
+
+  LatencyPhase phase() const {
+    return page > 0 ? LatencyPhase::kSteadyState
+                    : LatencyPhaseForOperationIndex(index);
+  }
+  std::chrono::steady_clock::duration latency() const { return end - start; }
+  std::chrono::steady_clock::duration first_attempt_latency() const {
+    return first_attempt_end - start;
+  }
+};
+
+// The peak resident set size of the process so far, or 0 if it is unknown.
+uint64_t PeakResidentSetBytes() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                            sizeof(counters))) {
+    return 0;
+  }
+  return counters.PeakWorkingSetSize;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+#ifdef __APPLE__
+  // macOS reports bytes, Linux kilobytes.
+  return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+  return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+std::string FormattedMebibytes(uint64_t bytes) {
+  std::ostringstream ss;
+  ss << std::fixed << std::setprecision(1) << bytes / (1024.0 * 1024.0)
+     << " MiB";
+  return ss.str();
+}
+
+// The directory under which the desktop SDK keeps the LevelDB files of
+// Firestore's offline persistence, one subdirectory per App and project.
+std::string FirestoreDataDirectory() {
+#ifdef _WIN32
+  const char* local_app_data = std::getenv("LOCALAPPDATA");
+  return local_app_data ? std::string(local_app_data) + "\\firestore" : "";
+#else
+  const char* home = std::getenv("HOME");
+#ifdef __APPLE__
+  return home ? std::string(home) + "/Library/Application Support/firestore"
+              : "";
+#else
+  const char* data_home = std::getenv("XDG_DATA_HOME");
+  if (data_home && *data_home) {
+    return std::string(data_home) + "/firestore";
+  }
+  return home ? std::string(home) + "/.local/share/firestore" : "";
+#endif
+#endif
+}
+
+// The total size of the files under `path`, or 0 if it does not exist.
+uint64_t DirectorySizeBytes(const std::string& path) {
+  uint64_t total = 0;
+#ifdef _WIN32
+  WIN32_FIND_DATAA entry;
+  HANDLE find = FindFirstFileA((path + "\\*").c_str(), &entry);
+  if (find == INVALID_HANDLE_VALUE) {
+    return 0;
+  }
+  do {
+    std::string name = entry.cFileName;
+    if (name == "." || name == "..") {
+      continue;
+    }
+    if (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+      total += DirectorySizeBytes(path + "\\" + name);
+    } else {
+      total += (static_cast<uint64_t>(entry.nFileSizeHigh) << 32) |
+               entry.nFileSizeLow;
+    }
+  } while (FindNextFileA(find, &entry));
+  FindClose(find);
+#else
+  DIR* directory = opendir(path.c_str());
+  if (!directory) {
+    return 0;
+  }
+  while (dirent* entry = readdir(directory)) {
+    std::string name = entry->d_name;
+    if (name == "." || name == "..") {
+      continue;
+    }
+    std::string child = path + "/" + name;
+    struct stat info;
+    if (lstat(child.c_str(), &info) != 0) {
+      continue;
+    }
+    if (S_ISDIR(info.st_mode)) {
+      total += DirectorySizeBytes(child);
+    } else if (S_ISREG(info.st_mode)) {
+      total += static_cast<uint64_t>(info.st_size);
+    }
+  }
+  closedir(directory);
+#endif
+  return total;
+}
+
+// A latency in milliseconds, to the microsecond.
+std::string FormattedMillis(uint64_t nanos) {
+  std::ostringstream ss;
+  ss << std::fixed << std::setprecision(3) << (nanos / 1000000.0);
+  return ss.str();
+}
+
+// Collects per-operation latencies, split by operation kind and by whether the
+// operation was the first one of the run (which pays for establishing the
+// backend connection) or a steady-state operation issued after it.
+class OperationLatencyStats {
+ public:
+  void Record(const OperationRecord& record) {
+    Entry& entry = entries_[std::make_pair(record.operation, record.phase())];
+    auto latency_nanos =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(record.latency());
+    entry.histogram.Record(latency_nanos);
+    entry.item_count += record.item_count;
+    entry.total_nanos += latency_nanos.count();
+    if (record.error != Error::kErrorOk) {
+      entry.error_count++;
+    }
+    if (record.origin != DataOrigin::kNone) {
+      Entry& origin_entry = read_origins_[record.origin];
+      origin_entry.histogram.Record(latency_nanos);
+      origin_entry.item_count++;
+      origin_entry.total_nanos += latency_nanos.count();
+    }
+    attempt_count_ += record.attempts;
+    if (record.error == Error::kErrorOk) {
+      success_count_++;
+    }
+    if (record.attempts > 1) {
+      retried_first_attempts_.Record(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              record.first_attempt_latency()));
+      retry_added_latency_.Record(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              record.end - record.first_attempt_end));
+    }
+    if (record.operation == Operation::kTransaction ||
+        record.operation == Operation::kIncrement) {
+      CounterEntry& counter = counters_[record.operation];
+      if (counter.committed + counter.failed == 0 ||
+          record.start < counter.first_start) {
+        counter.first_start = record.start;
+      }
+      counter.last_end = std::max(counter.last_end, record.end);
+      if (record.error == Error::kErrorOk) {
+        counter.committed++;
+      } else {
+        counter.failed++;
+      }
+      counter.attempts += record.transaction_attempts;
+      if (record.transaction_attempts > 1) {
+        counter.retried++;
+      }
+      if (record.operation == Operation::kTransaction) {
+        counter
+            .latency_by_attempts[std::min(record.transaction_attempts,
+                                          kMaxTransactionAttemptsRow)]
+            .Record(latency_nanos);
+      }
+    }
+    if (record.operation == Operation::kQuery) {
+      if (query_pages_.pages == 0 || record.start < query_pages_.first_start) {
+        query_pages_.first_start = record.start;
+      }
+      query_pages_.last_end = std::max(query_pages_.last_end, record.end);
+      query_pages_.pages++;
+      query_pages_.documents += record.item_count;
+      query_pages_.bytes += record.payload_bytes;
+    }
+    if (record.result_extracted && record.error == Error::kErrorOk) {
+      extracted_read_count_++;
+      extraction_allocations_.count += record.result_allocations.count;
+      extraction_allocations_.bytes += record.result_allocations.bytes;
+    }
+  }
+
+  // Records that a hedged read was issued, and whether it won the race against
+  // the original read.
+  void RecordHedge(bool won) {
+    hedges_issued_++;
+    if (won) {
+      hedges_won_++;
+    }
+  }
+
+  // Returns null if no operation of that kind and phase was recorded.
+  const LatencyHistogram* histogram(Operation operation,
+                                    LatencyPhase phase) const {
+    auto it = entries_.find(std::make_pair(operation, phase));
+    return it == entries_.end() ? nullptr : &it->second.histogram;
+  }
+
+  uint64_t operation_count() const {
+    uint64_t count = 0;
+    for (const auto& item : entries_) {
+      count += item.second.histogram.count();
+    }
+    return count;
+  }
+
+  void LogSummary() const {
+    if (entries_.empty()) {
+      return;
+    }
+    Log("=======================================");
+    Log("Latency summary (milliseconds):");
+    Log(FormattedSummaryRow("operation", "count", "errors", "p50", "p90",
+                            "p99", "p99.9", "max"));
+    for (const auto& item : entries_) {
+      const LatencyHistogram& histogram = item.second.histogram;
+      std::string label = OperationKindName(item.first.first) +
+                          (item.first.second == LatencyPhase::kFirstOperation
+                               ? " (first op)"
+                               : " (steady state)");
+      Log(FormattedSummaryRow(
+          label, std::to_string(histogram.count()),
+          std::to_string(item.second.error_count),
+          FormattedMillis(histogram.ValueAtPercentile(50)),
+          FormattedMillis(histogram.ValueAtPercentile(90)),
+          FormattedMillis(histogram.ValueAtPercentile(99)),
+          FormattedMillis(histogram.ValueAtPercentile(99.9)),
+          FormattedMillis(histogram.max())));
+    }
+    for (const auto& item : entries_) {
+      if (item.first.first != Operation::kBatchWrite) {
+        continue;
+      }
+      const Entry& entry = item.second;
+      Log(OperationKindName(item.first.first),
+          item.first.second == LatencyPhase::kFirstOperation
+              ? " (first op): "
+              : " (steady state): ",
+          entry.histogram.count(), " batches of ", entry.item_count,
+          " writes total, amortized ",
+          FormattedMillis(entry.total_nanos / entry.item_count),
+          " ms per write");
+    }
+    for (const auto& item : entries_) {
+      if (item.first.first != Operation::kFanOut) {
+        continue;
+      }
+      auto documents = entries_.find(
+          std::make_pair(Operation::kFanOutDocument, item.first.second));
+      if (documents == entries_.end()) {
+        continue;
+      }
+      const LatencyHistogram& slowest = item.second.histogram;
+      const LatencyHistogram& each = documents->second.histogram;
+      std::ostringstream ratio;
+      ratio << std::fixed << std::setprecision(2)
+            << static_cast<double>(slowest.ValueAtPercentile(50)) /
+                   std::max<uint64_t>(each.ValueAtPercentile(50), 1);
+      Log(OperationKindName(item.first.first),
+          item.first.second == LatencyPhase::kFirstOperation
+              ? " (first op): "
+              : " (steady state): ",
+          "slowest of ", item.second.item_count / slowest.count(),
+          " documents p50 ", FormattedMillis(slowest.ValueAtPercentile(50)),
+          " ms vs ", FormattedMillis(each.ValueAtPercentile(50)),
+          " ms per document (", ratio.str(), "x)");
+    }
+    if (extracted_read_count_ > 0) {
+      Log("Read result extraction: ",
+          extraction_allocations_.count / extracted_read_count_,
+          " allocations, ",
+          extraction_allocations_.bytes / extracted_read_count_,
+          " bytes per read on average (", extracted_read_count_, " reads)");
+    }
+    if (!read_origins_.empty()) {
+      Log("Successful reads by origin (milliseconds):");
+      uint64_t read_count = 0;
+      for (const auto& item : read_origins_) {
+        read_count += item.second.histogram.count();
+      }
+      for (const auto& item : read_origins_) {
+        const LatencyHistogram& histogram = item.second.histogram;
+        Log(FormattedSummaryRow(
+            "read from " + DataOriginName(item.first) + " (" +
+                FormattedPercent(histogram.count(), read_count) + ")",
+            std::to_string(histogram.count()), "0",
+            FormattedMillis(histogram.ValueAtPercentile(50)),
+            FormattedMillis(histogram.ValueAtPercentile(90)),
+            FormattedMillis(histogram.ValueAtPercentile(99)),
+            FormattedMillis(histogram.ValueAtPercentile(99.9)),
+            FormattedMillis(histogram.max())));
+      }
+    }
+    if (retried_first_attempts_.count() > 0) {
+      std::ostringstream ss;
+      ss << std::fixed << std::setprecision(3)
+         << (success_count_ > 0
+                 ? static_cast<double>(attempt_count_) / success_count_
+                 : 0.0);
+      Log("Retries: ", retried_first_attempts_.count(), " operations retried, ",
+          attempt_count_, " attempts for ", success_count_, " successes (",
+          ss.str(), " attempts per success); retried operations",
+          " (milliseconds):");
+      LogHistogramRow("first attempt", retried_first_attempts_);
+      LogHistogramRow("added by retries", retry_added_latency_);
+    }
+    for (const auto& item : counters_) {
+      const CounterEntry& counter = item.second;
+      std::chrono::duration<double> elapsed_seconds =
+          counter.last_end - counter.first_start;
+      std::ostringstream ss;
+      ss << std::fixed << std::setprecision(2)
+         << (elapsed_seconds.count() > 0
+                 ? counter.committed / elapsed_seconds.count()
+                 : 0.0);
+      if (item.first == Operation::kIncrement) {
+        Log("Increments: ", counter.committed, " committed (", ss.str(),
+            "/s), ", counter.failed, " failed");
+        continue;
+      }
+      std::ostringstream attempts;
+      attempts << std::fixed << std::setprecision(3)
+               << (counter.committed > 0
+                       ? static_cast<double>(counter.attempts) /
+                             counter.committed
+                       : 0.0);
+      Log("Transactions: ", counter.committed, " committed (", ss.str(),
+          "/s), ", counter.failed, " failed, ", counter.retried,
+          " retried by the SDK, ", counter.attempts, " attempts (",
+          attempts.str(), " per commit); latency by attempts (milliseconds):");
+      for (const auto& row : counter.latency_by_attempts) {
+        std::string label = "txn, " + std::to_string(row.first) +
+                            (row.first == kMaxTransactionAttemptsRow
+                                 ? "+ attempts"
+                                 : row.first == 1 ? " attempt" : " attempts");
+        LogHistogramRow(label, row.second);
+      }
+    }
+    if (query_pages_.pages > 0) {
+      std::chrono::duration<double> elapsed_seconds =
+          query_pages_.last_end - query_pages_.first_start;
+      double seconds = std::max(elapsed_seconds.count(), 1e-9);
+      std::ostringstream ss;
+      ss << std::fixed << std::setprecision(2)
+         << query_pages_.documents / seconds << " docs/s, "
+         << query_pages_.bytes / seconds << " bytes/s";
+      Log("Queries: ", query_pages_.documents, " documents (",
+          query_pages_.bytes, " bytes) in ", query_pages_.pages, " pages (",
+          ss.str(), "); peak RSS ",
+          FormattedMebibytes(PeakResidentSetBytes()));
+    }
+    if (hedges_issued_ > 0) {
+      Log("Hedged reads: ", hedges_issued_, " issued, ", hedges_won_, " won (",
+          FormattedPercent(hedges_won_, hedges_issued_), ")");
+    }
+  }
+
+ private:
+  struct Entry {
+    LatencyHistogram histogram;
+    uint64_t error_count = 0;
+    uint64_t item_count = 0;
+    uint64_t total_nanos = 0;
+  };
+
+  // Throughput and contention of the operations that increment hot counters.
+  struct CounterEntry {
+    uint64_t committed = 0;
+    uint64_t failed = 0;
+    uint64_t attempts = 0;
+    uint64_t retried = 0;
+    std::chrono::steady_clock::time_point first_start;
+    std::chrono::steady_clock::time_point last_end;
+    // Transaction latency by the number of attempts, the last row counting
+    // `kMaxTransactionAttemptsRow` or more.
+    std::map<int, LatencyHistogram> latency_by_attempts;
+  };
+
+  static constexpr int kMaxTransactionAttemptsRow = 5;
+
+  struct QueryPages {
+    uint64_t pages = 0;
+    uint64_t documents = 0;
+    uint64_t bytes = 0;
+    std::chrono::steady_clock::time_point first_start;
+    std::chrono::steady_clock::time_point last_end;
+  };
+
+  static std::string FormattedPercent(uint64_t count, uint64_t total) {
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(1) << (100.0 * count / total) << "%";
+    return ss.str();
+  }
+
+  // Logs a summary row for a histogram that has no error count.
+  static void LogHistogramRow(const std::string& label,
+                              const LatencyHistogram& histogram) {
+    Log(FormattedSummaryRow(label, std::to_string(histogram.count()), "-",
+                            FormattedMillis(histogram.ValueAtPercentile(50)),
+                            FormattedMillis(histogram.ValueAtPercentile(90)),
+                            FormattedMillis(histogram.ValueAtPercentile(99)),
+                            FormattedMillis(histogram.ValueAtPercentile(99.9)),
+                            FormattedMillis(histogram.max())));
+  }
+
+  static std::string FormattedSummaryRow(
+      const std::string& label, const std::string& count,
+      const std::string& errors, const std::string& p50,
+      const std::string& p90, const std::string& p99, const std::string& p999,
+      const std::string& max) {
+    std::ostringstream ss;
+    ss << std::left << std::setw(26) << label << std::right << std::setw(8)
+       << count << std::setw(8) << errors << std::setw(12) << p50
+       << std::setw(12) << p90 << std::setw(12) << p99 << std::setw(12)
+       << p999 << std::setw(12) << max;
+    return ss.str();
+  }
+
+  std::map<std::pair<Operation, LatencyPhase>, Entry> entries_;
+  std::map<DataOrigin, Entry> read_origins_;
+  std::map<Operation, CounterEntry> counters_;
+  QueryPages query_pages_;
+  uint64_t attempt_count_ = 0;
+  uint64_t success_count_ = 0;
+  LatencyHistogram retried_first_attempts_;
+  LatencyHistogram retry_added_latency_;
+  uint64_t extracted_read_count_ = 0;
+  AllocationCounts extraction_allocations_;
+  uint64_t hedges_issued_ = 0;
+  uint64_t hedges_won_ = 0;
+};
+
+constexpr int OperationLatencyStats::kMaxTransactionAttemptsRow;
+
+// Writes one machine-readable record per completed operation, either as JSON
+// lines or as CSV with a header row. Records are accumulated in memory and
+// written out in large chunks so that output keeps up with high operation
+// rates.
+class ResultsWriter {
+ public:
+  // Returns null if the file cannot be opened. A `path` of "-" means stdout.
+  static std::unique_ptr<ResultsWriter> Open(ResultsFormat format,
+                                             const std::string& path) {
+    std::FILE* file = stdout;
+    if (path != "-") {
+      file = std::fopen(path.c_str(), "wb");
+      if (!file) {
+        return nullptr;
+      }
+    }
+    return std::unique_ptr<ResultsWriter>(new ResultsWriter(format, file));
+  }
+
+  ~ResultsWriter() {
+    Flush();
+    if (file_ != stdout) {
+      std::fclose(file_);
+    }
+  }
+
+  ResultsWriter(const ResultsWriter&) = delete;
+  ResultsWriter& operator=(const ResultsWriter&) = delete;
+
+  void Write(const OperationRecord& record) {
+    std::string error_name = FirestoreErrorNameFromErrorCode(record.error);
+    std::string phase = record.phase() == LatencyPhase::kFirstOperation
+                            ? "first"
+                            : "steady";
+    switch (format_) {
+      case ResultsFormat::kJsonLines:
+        buffer_ += "{\"operation\":";
+        AppendJsonString(OperationKindName(record.operation));
+        buffer_ += ",\"index\":";
+        buffer_ += std::to_string(record.index);
+        buffer_ += ",\"phase\":";
+        AppendJsonString(phase);
+        buffer_ += ",\"doc_path\":";
+        AppendJsonString(record.doc_path);
+        buffer_ += ",\"start_ns\":";
+        buffer_ += std::to_string(SteadyClockNanos(record.start));
+        buffer_ += ",\"end_ns\":";
+        buffer_ += std::to_string(SteadyClockNanos(record.end));
+        buffer_ += ",\"latency_ns\":";
+        buffer_ += std::to_string(
+            SteadyClockNanos(record.end) - SteadyClockNanos(record.start));
+        buffer_ += ",\"error\":";
+        AppendJsonString(error_name);
+        buffer_ += ",\"payload_bytes\":";
+        buffer_ += std::to_string(record.payload_bytes);
+        buffer_ += ",\"item_count\":";
+        buffer_ += std::to_string(record.item_count);
+        buffer_ += ",\"origin\":";
+        AppendJsonString(DataOriginName(record.origin));
+        buffer_ += ",\"attempts\":";
+        buffer_ += std::to_string(record.attempts);
+        buffer_ += ",\"transaction_attempts\":";
+        buffer_ += std::to_string(record.transaction_attempts);
+        buffer_ += "}\n";
+        break;
+      case ResultsFormat::kCsv:
+        AppendCsvField(OperationKindName(record.operation));
+        buffer_ += ',';
+        buffer_ += std::to_string(record.index);
+        buffer_ += ',';
+        buffer_ += phase;
+        buffer_ += ',';
+        AppendCsvField(record.doc_path);
+        buffer_ += ',';
+        buffer_ += std::to_string(SteadyClockNanos(record.start));
+        buffer_ += ',';
+        buffer_ += std::to_string(SteadyClockNanos(record.end));
+        buffer_ += ',';
+        buffer_ += std::to_string(SteadyClockNanos(record.end) -
+                                  SteadyClockNanos(record.start));
+        buffer_ += ',';
+        AppendCsvField(error_name);
+        buffer_ += ',';
+        buffer_ += std::to_string(record.payload_bytes);
+        buffer_ += ',';
+        buffer_ += std::to_string(record.item_count);
+        buffer_ += ',';
+        buffer_ += DataOriginName(record.origin);
+        buffer_ += ',';
+        buffer_ += std::to_string(record.attempts);
+        buffer_ += ',';
+        buffer_ += std::to_string(record.transaction_attempts);
+        buffer_ += '\n';
+        break;
+    }
+    if (buffer_.size() >= kFlushThreshold) {
+      Flush();
+    }
+  }
+
+  void Flush() {
+    if (!buffer_.empty()) {
+      std::fwrite(buffer_.data(), 1, buffer_.size(), file_);
+      buffer_.clear();
+    }
+    std::fflush(file_);
+  }
+
+ private:
+  static constexpr std::size_t kFlushThreshold = 1 << 16;
+
+  ResultsWriter(ResultsFormat format, std::FILE* file)
+      : format_(format), file_(file) {
+    buffer_.reserve(2 * kFlushThreshold);
+    if (format_ == ResultsFormat::kCsv) {
+      buffer_ +=
+          "operation,index,phase,doc_path,start_ns,end_ns,latency_ns,error,"
+          "payload_bytes,item_count,origin,attempts,"
+          "transaction_attempts\n";
+    }
+  }
+
+  static int64_t SteadyClockNanos(std::chrono::steady_clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               time.time_since_epoch())
+        .count();
+  }
+
+  void AppendJsonString(const std::string& value) {
+    buffer_ += '"';
+    for (char c : value) {
+      switch (c) {
+        case '"':
+          buffer_ += "\\\"";
+          break;
+        case '\\':
+          buffer_ += "\\\\";
+          break;
+        case '\n':
+          buffer_ += "\\n";
+          break;
+        default:
+          if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            buffer_ += escaped;
+          } else {
+            buffer_ += c;
+          }
+      }
+    }
+    buffer_ += '"';
+  }
+
+  void AppendCsvField(const std::string& value) {
+    if (value.find_first_of(",\"\n") == std::string::npos) {
+      buffer_ += value;
+      return;
+    }
+    buffer_ += '"';
+    for (char c : value) {
+      if (c == '"') {
+        buffer_ += '"';
+      }
+      buffer_ += c;
+    }
+    buffer_ += '"';
+  }
+
+  const ResultsFormat format_;
+  std::FILE* const file_;
+  std::string buffer_;
+};
+
+// Estimates the number of bytes a value occupies: the length of strings and
+// blobs, 8 bytes for scalars, and the sum of the contents of arrays and maps.
+std::size_t ApproximateFieldValueSize(const FieldValue& value) {
+  switch (value.type()) {
+    case FieldValue::Type::kString:
+      return value.string_value().size();
+    case FieldValue::Type::kBlob:
+      return value.blob_size();
+    case FieldValue::Type::kArray: {
+      std::size_t size = 0;
+      for (const FieldValue& element : value.array_value()) {
+        size += ApproximateFieldValueSize(element);
+      }
+      return size;
+    }
+    case FieldValue::Type::kMap: {
+      std::size_t size = 0;
+      for (const auto& entry : value.map_value()) {
+        size += entry.first.size() + ApproximateFieldValueSize(entry.second);
+      }
+      return size;
+    }
+    default:
+      return 8;
+  }
+}
+
+std::size_t ApproximateDocumentSize(const MapFieldValue& data) {
+  std::size_t size = 0;
+  for (const auto& entry : data) {
+    size += entry.first.size() + ApproximateFieldValueSize(entry.second);
+  }
+  return size;
+}
+
+uint64_t NextPayloadId() {
+  static std::atomic<uint64_t> next_id(1);
+  return next_id++;
+}
+
+// A document to write, generated before any operation is timed.
+struct Payload {
+  // Identifies the payload in --record traces.
+  uint64_t id = NextPayloadId();
+  MapFieldValue data;
+  // The approximate size of `data`, as computed by ApproximateDocumentSize().
+  std::size_t size = 0;
+  std::string description;
+};
+
+Payload MakeSingleFieldPayload(const std::string& key,
+                               const std::string& value) {
+  Payload payload;
+  payload.data[key] = FieldValue::String(value);
+  payload.size = key.size() + value.size();
+  payload.description = key + "=" + value;
+  return payload;
+}
+
+// Supplies the documents set by write operations. Unless generated payloads
+// are enabled, every write sets the single --key/--value field. Otherwise a
+// pool of documents is generated up front from values sliced out of a
+// preallocated arena of random bytes, so that none of the generation cost is
+// included in the timing of the writes, which then cycle through the pool.
+// Not thread-safe.
+class PayloadGenerator {
+ public:
+  PayloadGenerator(const std::string& key, const std::string& value,
+                   const PayloadOptions& options)
+      : options_(options), rng_(std::random_device()()) {
+    if (options_.field_count == 0) {
+      pool_.push_back(MakeSingleFieldPayload(key, value));
+      description_ = pool_[0].description;
+      return;
+    }
+
+    arena_.resize(2 * static_cast<std::size_t>(options_.max_value_bytes) +
+                  4096);
+    std::uniform_int_distribution<int> letter('a', 'z');
+    for (char& c : arena_) {
+      c = static_cast<char>(letter(rng_));
+    }
+    std::size_t document_bytes =
+        static_cast<std::size_t>(options_.field_count) *
+        (static_cast<std::size_t>(options_.max_value_bytes) + 16);
+    std::size_t pool_size = std::max<std::size_t>(
+        1, std::min(kMaxPoolSize, kMaxPoolBytes / document_bytes));
+    std::size_t total_size = 0;
+    for (std::size_t i = 0; i < pool_size; i++) {
+      pool_.push_back(Generate());
+      total_size += pool_.back().size;
+    }
+    description_ = std::to_string(options_.field_count) + " generated fields";
+    Log("Generated ", pool_size, " documents of ", options_.field_count,
+        " fields, ", total_size / pool_size, " bytes on average");
+  }
+
+  const Payload& Next() {
+    const Payload& payload = pool_[next_];
+    next_ = (next_ + 1) % pool_.size();
+    return payload;
+  }
+
+  std::vector<const Payload*> Next(int count) {
+    std::vector<const Payload*> payloads;
+    for (int i = 0; i < count; i++) {
+      payloads.push_back(&Next());
+    }
+    return payloads;
+  }
+
+  const std::string& description() const { return description_; }
+
+ private:
+  static constexpr std::size_t kMaxPoolSize = 64;
+  static constexpr std::size_t kMaxPoolBytes = 64 << 20;
+
+  Payload Generate() {
+    Payload payload;
+    for (int i = 0; i < options_.field_count; i++) {
+      payload.data["field" + std::to_string(i)] = GenerateField(i);
+    }
+    payload.size = ApproximateDocumentSize(payload.data);
+    payload.description = std::to_string(options_.field_count) +
+                          " generated fields (" +
+                          std::to_string(payload.size) + " bytes)";
+    return payload;
+  }
+
+  FieldValue GenerateField(int field_index) {
+    FieldValue value = GenerateValue(field_index);
+    for (int depth = 0; depth < options_.nesting_depth; depth++) {
+      if (depth % 2 == 0) {
+        MapFieldValue map;
+        map["value"] = std::move(value);
+        value = FieldValue::Map(std::move(map));
+      } else {
+        value = FieldValue::Array(std::vector<FieldValue>{value});
+      }
+    }
+    return value;
+  }
+
+  FieldValue GenerateValue(int field_index) {
+    PayloadValueType type = options_.value_type;
+    if (type == PayloadValueType::kMixed) {
+      switch (field_index % 3) {
+        case 0:
+          type = PayloadValueType::kString;
+          break;
+        case 1:
+          type = PayloadValueType::kBlob;
+          break;
+        default:
+          return FieldValue::Integer(static_cast<int64_t>(rng_()));
+      }
+    }
+    std::size_t size = ValueSize();
+    std::size_t offset = std::uniform_int_distribution<std::size_t>(
+        0, arena_.size() - size)(rng_);
+    if (type == PayloadValueType::kBlob) {
+      return FieldValue::Blob(
+          reinterpret_cast<const uint8_t*>(arena_.data() + offset), size);
+    }
+    return FieldValue::String(arena_.substr(offset, size));
+  }
+
+  std::size_t ValueSize() {
+    if (options_.size_distribution == ValueSizeDistribution::kLogUniform) {
+      double log_size = std::uniform_real_distribution<double>(
+          std::log(options_.min_value_bytes),
+          std::log(options_.max_value_bytes))(rng_);
+      return std::min<std::size_t>(
+          options_.max_value_bytes,
+          static_cast<std::size_t>(std::round(std::exp(log_size))));
+    }
+    return std::uniform_int_distribution<std::size_t>(
+        options_.min_value_bytes, options_.max_value_bytes)(rng_);
+  }
+
+  const PayloadOptions options_;
+  std::mt19937_64 rng_;
+  std::string arena_;
+  std::vector<Payload> pool_;
+  std::size_t next_ = 0;
+  std::string description_;
+};
+
+constexpr std::size_t PayloadGenerator::kMaxPoolSize;
+constexpr std::size_t PayloadGenerator::kMaxPoolBytes;
+
+// The --record/--replay trace format: a header, a fixed-size record for every
+// issued operation, then tables of the distinct document paths and payloads
+// that the records refer to by index, and the payload indexes of every batch,
+// one run per kBatchWrite. All integers are in host byte order.
+// Records are read in place from a memory mapping of the file, so replaying
+// even millions of operations needs no parsing up front.
+struct TraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t record_count;
+  uint64_t paths_offset;
+  uint64_t payloads_offset;
+};
+
+struct TraceRecord {
+  // The time the operation was issued, relative to the first operation.
+  int64_t offset_nanos;
+  uint32_t path_index;
+  // kNoPayload for operations that do not write. For a kBatchWrite, the index
+  // into the batch table of the first write's payload index.
+  uint32_t payload_index;
+  uint8_t operation;
+  uint8_t reserved[3];
+  // The number of writes in a kBatchWrite, otherwise 1.
+  uint32_t item_count;
+};
+
+constexpr char kTraceMagic[8] = {'U', 'I', '1', '1', '5', '4', 'T', 'R'};
+constexpr uint32_t kTraceVersion = 1;
+constexpr uint32_t kNoPayload = 0xffffffff;
+
+static_assert(sizeof(TraceHeader) == 40, "unexpected TraceHeader padding");
+static_assert(sizeof(TraceRecord) == 24, "unexpected TraceRecord padding");
+
+// Serializes field values with a one-byte type tag. Types that a workload
+// never writes (timestamps, references, geo points and the sentinels other
+// than server timestamps) are encoded as null.
+class FieldValueEncoding {
+ public:
+  static void Encode(const FieldValue& value, std::string& out) {
+    switch (value.type()) {
+      case FieldValue::Type::kBoolean:
+        out += static_cast<char>(kBoolean);
+        out += static_cast<char>(value.boolean_value() ? 1 : 0);
+        return;
+      case FieldValue::Type::kInteger:
+        out += static_cast<char>(kInteger);
+        AppendRaw(value.integer_value(), out);
+        return;
+      case FieldValue::Type::kDouble:
+        out += static_cast<char>(kDouble);
+        AppendRaw(value.double_value(), out);
+        return;
+      case FieldValue::Type::kString:
+        out += static_cast<char>(kString);
+        AppendBytes(value.string_value().data(), value.string_value().size(),
+                    out);
+        return;
+      case FieldValue::Type::kBlob:
+        out += static_cast<char>(kBlob);
+        AppendBytes(reinterpret_cast<const char*>(value.blob_value()),
+                    value.blob_size(), out);
+        return;
+      case FieldValue::Type::kArray: {
+        std::vector<FieldValue> elements = value.array_value();
+        out += static_cast<char>(kArray);
+        AppendRaw(static_cast<uint32_t>(elements.size()), out);
+        for (const FieldValue& element : elements) {
+          Encode(element, out);
+        }
+        return;
+      }
+      case FieldValue::Type::kMap:
+        out += static_cast<char>(kMap);
+        EncodeMap(value.map_value(), out);
+        return;
+      case FieldValue::Type::kServerTimestamp:
+        out += static_cast<char>(kServerTimestamp);
+        return;
+      default:
+        out += static_cast<char>(kNull);
+        return;
+    }
+  }
+
+  static void EncodeMap(const MapFieldValue& map, std::string& out) {
+    AppendRaw(static_cast<uint32_t>(map.size()), out);
+    for (const MapFieldValue::value_type& entry : map) {
+      AppendBytes(entry.first.data(), entry.first.size(), out);
+      Encode(entry.second, out);
+    }
+  }
+
+  // Decodes a map encoded by EncodeMap() from [`data`, `end`), advancing
+  // `data` past it. Returns false if the data is truncated or malformed.
+  static bool DecodeMap(const char*& data, const char* end,
+                        MapFieldValue& map) {
+    uint32_t size = 0;
+    if (!ReadRaw(data, end, size)) {
+      return false;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+      std::string key;
+      FieldValue value;
+      if (!ReadBytes(data, end, key) || !Decode(data, end, value)) {
+        return false;
+      }
+      map.emplace(std::move(key), std::move(value));
+    }
+    return true;
+  }
+
+ private:
+  enum Tag : uint8_t {
+    kNull,
+    kBoolean,
+    kInteger,
+    kDouble,
+    kString,
+    kBlob,
+    kArray,
+    kMap,
+    kServerTimestamp,
+  };
+
+  template <typename T>
+  static void AppendRaw(T value, std::string& out) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  static void AppendBytes(const char* data, std::size_t size,
+                          std::string& out) {
+    AppendRaw(static_cast<uint32_t>(size), out);
+    out.append(data, size);
+  }
+
+  template <typename T>
+  static bool ReadRaw(const char*& data, const char* end, T& value) {
+    if (static_cast<std::size_t>(end - data) < sizeof(value)) {
+      return false;
+    }
+    std::memcpy(&value, data, sizeof(value));
+    data += sizeof(value);
+    return true;
+  }
+
+  static bool ReadBytes(const char*& data, const char* end,
+                        std::string& bytes) {
+    uint32_t size = 0;
+    if (!ReadRaw(data, end, size) ||
+        static_cast<std::size_t>(end - data) < size) {
+      return false;
+    }
+    bytes.assign(data, size);
+    data += size;
+    return true;
+  }
+
+  static bool Decode(const char*& data, const char* end, FieldValue& value) {
+    if (data == end) {
+      return false;
+    }
+    uint8_t tag = static_cast<uint8_t>(*data++);
+    switch (tag) {
+      case kNull:
+        value = FieldValue::Null();
+        return true;
+      case kBoolean: {
+        uint8_t boolean = 0;
+        if (!ReadRaw(data, end, boolean)) {
+          return false;
+        }
+        value = FieldValue::Boolean(boolean != 0);
+        return true;
+      }
+      case kInteger: {
+        int64_t integer = 0;
+        if (!ReadRaw(data, end, integer)) {
+          return false;
+        }
+        value = FieldValue::Integer(integer);
+        return true;
+      }
+      case kDouble: {
+        double number = 0;
+        if (!ReadRaw(data, end, number)) {
+          return false;
+        }
+        value = FieldValue::Double(number);
+        return true;
+      }
+      case kString:
+      case kBlob: {
+        std::string bytes;
+        if (!ReadBytes(data, end, bytes)) {
+          return false;
+        }
+        value = tag == kString
+                    ? FieldValue::String(std::move(bytes))
+                    : FieldValue::Blob(
+                          reinterpret_cast<const uint8_t*>(bytes.data()),
+                          bytes.size());
+        return true;
+      }
+      case kArray: {
+        uint32_t size = 0;
+        if (!ReadRaw(data, end, size)) {
+          return false;
+        }
+        std::vector<FieldValue> elements(size);
+        for (FieldValue& element : elements) {
+          if (!Decode(data, end, element)) {
+            return false;
+          }
+        }
+        value = FieldValue::Array(std::move(elements));
+        return true;
+      }
+      case kMap: {
+        MapFieldValue map;
+        if (!DecodeMap(data, end, map)) {
+          return false;
+        }
+        value = FieldValue::Map(std::move(map));
+        return true;
+      }
+      case kServerTimestamp:
+        value = FieldValue::ServerTimestamp();
+        return true;
+    }
+    return false;
+  }
+};
+
+// Writes a --record trace. Not thread-safe.
+class TraceWriter {
+ public:
+  // Returns null if the file cannot be created.
+  static std::unique_ptr<TraceWriter> Open(const std::string& path) {
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+      return nullptr;
+    }
+    TraceHeader header = {};
+    if (std::fwrite(&header, sizeof(header), 1, file) != 1) {
+      std::fclose(file);
+      return nullptr;
+    }
+    return std::unique_ptr<TraceWriter>(new TraceWriter(file));
+  }
+
+  ~TraceWriter() { Close(); }
+
+  void Append(Operation operation, const std::string& path,
+              const Payload* payload, int item_count) {
+    Append(operation, path,
+           payload ? std::vector<const Payload*>{payload}
+                   : std::vector<const Payload*>(),
+           item_count);
+  }
+
+  // Appends a kBatchWrite of every one of `batch`.
+  void Append(Operation operation, const std::string& path,
+              const std::vector<const Payload*>& batch) {
+    Append(operation, path, batch, static_cast<int>(batch.size()));
+  }
+
+  // Writes the path, payload and batch tables and the header. Returns whether
+  // the whole trace was written successfully.
+  bool Close() {
+    if (!file_) {
+      return ok_;
+    }
+    TraceHeader header = {};
+    std::memcpy(header.magic, kTraceMagic, sizeof(header.magic));
+    header.version = kTraceVersion;
+    header.record_count = record_count_;
+    header.paths_offset =
+        sizeof(TraceHeader) + record_count_ * sizeof(TraceRecord);
+    WriteTable(paths_.size(), [this](std::size_t i) { return *paths_[i]; });
+    header.payloads_offset = static_cast<uint64_t>(std::ftell(file_));
+    WriteTable(encoded_payloads_.size(),
+               [this](std::size_t i) { return encoded_payloads_[i]; });
+    uint32_t batch_index_count = static_cast<uint32_t>(batch_indexes_.size());
+    ok_ = ok_ &&
+          std::fwrite(&batch_index_count, sizeof(batch_index_count), 1,
+                      file_) == 1 &&
+          std::fwrite(batch_indexes_.data(), sizeof(uint32_t),
+                      batch_indexes_.size(),
+                      file_) == batch_indexes_.size();
+    ok_ = ok_ && std::fseek(file_, 0, SEEK_SET) == 0 &&
+          std::fwrite(&header, sizeof(header), 1, file_) == 1;
+    ok_ = std::fclose(file_) == 0 && ok_;
+    file_ = nullptr;
+    Log("Recorded ", record_count_, " operations, ", paths_.size(),
+        " documents and ", encoded_payloads_.size(), " payloads",
+        ok_ ? "" : " (FAILED to write the trace)");
+    return ok_;
+  }
+
+ private:
+  explicit TraceWriter(std::FILE* file) : file_(file) {}
+
+  void Append(Operation operation, const std::string& path,
+              const std::vector<const Payload*>& payloads, int item_count) {
+    auto now = std::chrono::steady_clock::now();
+    if (record_count_ == 0) {
+      origin_ = now;
+    }
+    TraceRecord record = {};
+    record.offset_nanos =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(now - origin_)
+            .count();
+    auto path_index = path_indexes_.emplace(
+        path, static_cast<uint32_t>(path_indexes_.size()));
+    if (path_index.second) {
+      paths_.push_back(&path_index.first->first);
+    }
+    record.path_index = path_index.first->second;
+    record.payload_index = kNoPayload;
+    if (operation == Operation::kBatchWrite) {
+      record.payload_index = static_cast<uint32_t>(batch_indexes_.size());
+      for (const Payload* payload : payloads) {
+        batch_indexes_.push_back(PayloadIndex(*payload));
+      }
+    } else if (!payloads.empty()) {
+      record.payload_index = PayloadIndex(*payloads[0]);
+    }
+    record.operation = static_cast<uint8_t>(operation);
+    record.item_count = static_cast<uint32_t>(item_count);
+    ok_ = ok_ && std::fwrite(&record, sizeof(record), 1, file_) == 1;
+    record_count_++;
+  }
+
+  uint32_t PayloadIndex(const Payload& payload) {
+    auto payload_index = payload_indexes_.emplace(
+        payload.id, static_cast<uint32_t>(payload_indexes_.size()));
+    if (payload_index.second) {
+      encoded_payloads_.emplace_back();
+      FieldValueEncoding::EncodeMap(payload.data, encoded_payloads_.back());
+    }
+    return payload_index.first->second;
+  }
+
+  template <typename GetEntry>
+  void WriteTable(std::size_t size, GetEntry get_entry) {
+    uint32_t count = static_cast<uint32_t>(size);
+    ok_ = ok_ && std::fwrite(&count, sizeof(count), 1, file_) == 1;
+    for (std::size_t i = 0; i < size; i++) {
+      const std::string& entry = get_entry(i);
+      uint32_t length = static_cast<uint32_t>(entry.size());
+      ok_ = ok_ && std::fwrite(&length, sizeof(length), 1, file_) == 1 &&
+            std::fwrite(entry.data(), 1, entry.size(), file_) == entry.size();
+    }
+  }
+
+  std::FILE* file_;
+  bool ok_ = true;
+  uint64_t record_count_ = 0;
+  std::chrono::steady_clock::time_point origin_;
+  std::map<std::string, uint32_t> path_indexes_;
+  std::vector<const std::string*> paths_;
+  std::map<uint64_t, uint32_t> payload_indexes_;
+  std::vector<std::string> encoded_payloads_;
+  std::vector<uint32_t> batch_indexes_;
+};
+
+// A --replay trace, memory-mapped read-only. The records are accessed in
+// place; only the small path and payload tables are decoded when opened.
+class TraceReader {
+ public:
+  // Returns null, after logging why, if the file cannot be mapped or is not
+  // a valid trace.
+  static std::unique_ptr<TraceReader> Open(const std::string& path) {
+    std::unique_ptr<TraceReader> reader(new TraceReader);
+    if (!reader->Map(path)) {
+      Log("ERROR: Mapping trace file FAILED: ", path);
+      return nullptr;
+    } else if (!reader->Validate()) {
+      Log("ERROR: Invalid trace file: ", path);
+      return nullptr;
+    }
+    return reader;
+  }
+
+  ~TraceReader() { Unmap(); }
+
+  uint64_t record_count() const { return header().record_count; }
+
+  const TraceRecord& record(uint64_t index) const {
+    return reinterpret_cast<const TraceRecord*>(data_ +
+                                                sizeof(TraceHeader))[index];
+  }
+
+  const std::string& path(const TraceRecord& record) const {
+    return paths_[record.path_index];
+  }
+
+  // Null for records that carry no payload; the first write's payload for a
+  // kBatchWrite.
+  const Payload* payload(const TraceRecord& record) const {
+    if (record.payload_index == kNoPayload) {
+      return nullptr;
+    } else if (IndexesBatchTable(record)) {
+      return &payloads_[batch_indexes_[record.payload_index]];
+    }
+    return &payloads_[record.payload_index];
+  }
+
+  // The payload of every write of a kBatchWrite.
+  std::vector<const Payload*> batch(const TraceRecord& record) const {
+    std::vector<const Payload*> batch;
+    for (uint32_t i = 0; i < record.item_count; i++) {
+      batch.push_back(&payloads_[batch_indexes_[record.payload_index + i]]);
+    }
+    return batch;
+  }
+
+ private:
+  TraceReader() = default;
+
+  const TraceHeader& header() const {
+    return *reinterpret_cast<const TraceHeader*>(data_);
+  }
+
+  static bool IndexesBatchTable(const TraceRecord& record) {
+    return static_cast<Operation>(record.operation) == Operation::kBatchWrite;
+  }
+
+  bool Map(const std::string& path) {
+#ifdef _WIN32
+    file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE) {
+      return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) {
+      return false;
+    }
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping_) {
+      return false;
+    }
+    data_ = static_cast<const char*>(
+        MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+    size_ = static_cast<std::size_t>(size.QuadPart);
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size == 0) {
+      close(fd);
+      return false;
+    }
+    void* data = mmap(nullptr, static_cast<std::size_t>(status.st_size),
+                      PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    data_ = static_cast<const char*>(data);
+    size_ = static_cast<std::size_t>(status.st_size);
+#endif
+    return data_ != nullptr;
+  }
+
+  void Unmap() {
+#ifdef _WIN32
+    if (data_) {
+      UnmapViewOfFile(data_);
+    }
+    if (mapping_) {
+      CloseHandle(mapping_);
+    }
+    if (file_ != INVALID_HANDLE_VALUE) {
+      CloseHandle(file_);
+    }
+#else
+    if (data_) {
+      munmap(const_cast<char*>(data_), size_);
+    }
+#endif
+  }
+
+  bool Validate() {
+    if (size_ < sizeof(TraceHeader) ||
+        std::memcmp(header().magic, kTraceMagic, sizeof(kTraceMagic)) != 0 ||
+        header().version != kTraceVersion ||
+        // Checked first so that the size of the records cannot overflow.
+        header().record_count >
+            (size_ - sizeof(TraceHeader)) / sizeof(TraceRecord) ||
+        header().paths_offset !=
+            sizeof(TraceHeader) + header().record_count * sizeof(TraceRecord) ||
+        header().paths_offset > size_ || header().payloads_offset > size_) {
+      return false;
+    }
+
+    const char* end = data_ + size_;
+    const char* position = data_ + header().paths_offset;
+    uint32_t count = 0;
+    if (!ReadCount(position, end, count)) {
+      return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t length = 0;
+      if (!ReadCount(position, end, length) ||
+          static_cast<std::size_t>(end - position) < length) {
+        return false;
+      }
+      paths_.emplace_back(position, length);
+      position += length;
+    }
+
+    position = data_ + header().payloads_offset;
+    if (!ReadCount(position, end, count)) {
+      return false;
+    }
+    payloads_.resize(count);
+    for (Payload& payload : payloads_) {
+      uint32_t length = 0;
+      if (!ReadCount(position, end, length) ||
+          static_cast<std::size_t>(end - position) < length) {
+        return false;
+      }
+      const char* payload_end = position + length;
+      if (!FieldValueEncoding::DecodeMap(position, payload_end,
+                                         payload.data) ||
+          position != payload_end) {
+        return false;
+      }
+      payload.size = ApproximateDocumentSize(payload.data);
+      payload.description = std::to_string(payload.data.size()) +
+                            " replayed fields (" +
+                            std::to_string(payload.size) + " bytes)";
+    }
+
+    if (!ReadCount(position, end, count) ||
+        static_cast<std::size_t>(end - position) / sizeof(uint32_t) < count) {
+      return false;
+    }
+    batch_indexes_.resize(count);
+    std::memcpy(batch_indexes_.data(), position, count * sizeof(uint32_t));
+    for (uint32_t index : batch_indexes_) {
+      if (index >= payloads_.size()) {
+        return false;
+      }
+    }
+
+    for (uint64_t i = 0; i < record_count(); i++) {
+      const TraceRecord& trace_record = record(i);
+      std::size_t payload_table_size = IndexesBatchTable(trace_record)
+                                           ? batch_indexes_.size()
+                                           : payloads_.size();
+      std::size_t payload_count =
+          IndexesBatchTable(trace_record) ? trace_record.item_count : 1;
+      if (trace_record.path_index >= paths_.size() ||
+          (IndexesBatchTable(trace_record) && trace_record.item_count < 1) ||
+          (trace_record.payload_index != kNoPayload &&
+           (trace_record.payload_index > payload_table_size ||
+            payload_table_size - trace_record.payload_index <
+                payload_count)) ||
+          !IsReplayable(static_cast<Operation>(trace_record.operation))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // kListen and kFanOut operations are recorded as the writes they perform,
+  // kQuery operations are not recorded, and kDrain operations cannot be.
+  static bool IsReplayable(Operation operation) {
+    switch (operation) {
+      case Operation::kRead:
+      case Operation::kWrite:
+      case Operation::kBatchWrite:
+      case Operation::kTransaction:
+      case Operation::kIncrement:
+        return true;
+      case Operation::kListen:
+      case Operation::kQuery:
+      case Operation::kFanOut:
+      case Operation::kFanOutDocument:
+      case Operation::kDrain:
+      case Operation::kDrainWrite:
+      case Operation::kDrainEnqueue:
+        break;
+    }
+    return false;
+  }
+
+  static bool ReadCount(const char*& position, const char* end,
+                        uint32_t& count) {
+    if (end - position < static_cast<std::ptrdiff_t>(sizeof(count))) {
+      return false;
+    }
+    std::memcpy(&count, position, sizeof(count));
+    position += sizeof(count);
+    return true;
+  }
+
+#ifdef _WIN32
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE mapping_ = nullptr;
+#endif
+  const char* data_ = nullptr;
+  std::size_t size_ = 0;
+  std::vector<std::string> paths_;
+  std::vector<Payload> payloads_;
+  // The batch table, indexing `payloads_`.
+  std::vector<uint32_t> batch_indexes_;
+};
+
+// Collects spans and counters for the --chrome-trace file, which is written in
+// the Chrome trace_event JSON format understood by chrome://tracing and
+// Perfetto. Spans are grouped into one track per worker thread; spans of a
+// worker that overlap without nesting, such as pipelined operations, go on
+// extra tracks of that worker so that every in-flight operation is visible.
+// Timestamps are on the steady clock used by the results file, so the two
+// line up. Events are kept in memory and laid out when the trace is closed.
+class ChromeTraceWriter {
+ public:
+  // Returns null if the file cannot be opened. A `path` of "-" means stdout.
+  static std::unique_ptr<ChromeTraceWriter> Open(const std::string& path) {
+    std::FILE* file = stdout;
+    if (path != "-") {
+      file = std::fopen(path.c_str(), "wb");
+      if (!file) {
+        return nullptr;
+      }
+    }
+    return std::unique_ptr<ChromeTraceWriter>(new ChromeTraceWriter(file));
+  }
+
+  ~ChromeTraceWriter() {
+    instance_.store(nullptr, std::memory_order_release);
+    if (file_ != stdout) {
+      std::fclose(file_);
+    }
+  }
+
+  ChromeTraceWriter(const ChromeTraceWriter&) = delete;
+  ChromeTraceWriter& operator=(const ChromeTraceWriter&) = delete;
+
+  // Adds a span on the track of the calling thread's worker, if a trace is
+  // being written. `args` is the body of a JSON object, or empty.
+  static void Span(const std::string& name, const char* category,
+                   std::chrono::steady_clock::time_point start,
+                   std::chrono::steady_clock::time_point end,
+                   std::string args = std::string()) {
+    ChromeTraceWriter* writer = instance_.load(std::memory_order_acquire);
+    if (writer) {
+      writer->Add(Event{'X', name, category, start, end, 0, CurrentWorker(),
+                        std::move(args)});
+    }
+  }
+
+  static void Counter(const std::string& name,
+                      std::chrono::steady_clock::time_point time,
+                      double value) {
+    ChromeTraceWriter* writer = instance_.load(std::memory_order_acquire);
+    if (writer) {
+      writer->Add(Event{'C', name, "resources", time, time, value, 0,
+                        std::string()});
+    }
+  }
+
+  static void OperationSpan(const OperationRecord& record) {
+    if (!instance_.load(std::memory_order_acquire)) {
+      return;
+    }
+    std::string args = "\"doc\":" + JsonString(record.doc_path) +
+                       ",\"error\":" +
+                       JsonString(FirestoreErrorNameFromErrorCode(
+                           record.error)) +
+                       ",\"attempts\":" + std::to_string(record.attempts);
+    if (record.item_count != 1) {
+      args += ",\"items\":" + std::to_string(record.item_count);
+    }
+    Span(OperationKindName(record.operation) + " #" +
+             std::to_string(record.index + 1),
+         "operation", record.start, record.end, std::move(args));
+  }
+
+  // Writes out the trace. Returns whether it was written successfully.
+  bool Close() {
+    instance_.store(nullptr, std::memory_order_release);
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::sort(events_.begin(), events_.end(),
+              [](const Event& a, const Event& b) {
+                return a.start != b.start ? a.start < b.start : a.end > b.end;
+              });
+
+    // Lays out each worker's spans on tracks numbered worker * kMaxTracks +
+    // track: a span goes on the first track where it starts after, or nests
+    // inside, the spans already there.
+    std::map<int, std::vector<std::vector<Clock::time_point>>> tracks;
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    for (const Event& event : events_) {
+      out += "{\"name\":" + JsonString(event.name) + ",\"cat\":\"" +
+             event.category + "\",\"ph\":\"" + event.phase +
+             "\",\"pid\":1,\"ts\":" + Micros(event.start);
+      if (event.phase == 'C') {
+        std::ostringstream value;
+        value << event.value;
+        out += ",\"args\":{\"value\":" + value.str() + "}},\n";
+        continue;
+      }
+      std::vector<std::vector<Clock::time_point>>& worker_tracks =
+          tracks[event.worker];
+      std::size_t track = 0;
+      for (; track < worker_tracks.size(); track++) {
+        std::vector<Clock::time_point>& open_ends = worker_tracks[track];
+        while (!open_ends.empty() && open_ends.back() <= event.start) {
+          open_ends.pop_back();
+        }
+        if (open_ends.empty() || event.end <= open_ends.back()) {
+          break;
+        }
+      }
+      if (track == worker_tracks.size()) {
+        worker_tracks.emplace_back();
+      }
+      worker_tracks[track].push_back(event.end);
+      out += ",\"dur\":" + Micros(event.start, event.end) + ",\"tid\":" +
+             std::to_string(ThreadId(event.worker, track)) + ",\"args\":{" +
+             event.args + "}},\n";
+    }
+    for (const auto& item : tracks) {
+      std::string worker_name =
+          item.first == 0 ? "main" : "worker " + std::to_string(item.first);
+      for (std::size_t track = 0; track < item.second.size(); track++) {
+        std::string tid = std::to_string(ThreadId(item.first, track));
+        std::string name =
+            track == 0 ? worker_name
+                       : worker_name + " (overlap " +
+                             std::to_string(track) + ")";
+        out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" +
+               tid + ",\"args\":{\"name\":" + JsonString(name) + "}},\n";
+        out += "{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1," +
+               ("\"tid\":" + tid) + ",\"args\":{\"sort_index\":" + tid +
+               "}},\n";
+      }
+    }
+    out +=
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{"
+        "\"name\":\"UnityIssue1154TestApp\"}}\n]}\n";
+    bool written = std::fwrite(out.data(), 1, out.size(), file_) ==
+                   out.size();
+    return std::fflush(file_) == 0 && written;
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Event {
+    // 'X' for a complete span, 'C' for a counter.
+    char phase;
+    std::string name;
+    const char* category;
+    Clock::time_point start;
+    Clock::time_point end;
+    double value;
+    int worker;
+    std::string args;
+  };
+
+  static constexpr int kMaxTracks = 1000;
+
+  explicit ChromeTraceWriter(std::FILE* file) : file_(file) {
+    instance_.store(this, std::memory_order_release);
+  }
+
+  void Add(Event event) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.push_back(std::move(event));
+  }
+
+  static int64_t ThreadId(int worker, std::size_t track) {
+    return static_cast<int64_t>(worker) * kMaxTracks +
+           static_cast<int64_t>(std::min<std::size_t>(track, kMaxTracks - 1));
+  }
+
+  static std::string Micros(Clock::time_point time) {
+    return Micros(Clock::time_point(), time);
+  }
+
+  static std::string Micros(Clock::time_point start, Clock::time_point end) {
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(3)
+       << std::chrono::duration<double, std::micro>(end - start).count();
+    return ss.str();
+  }
+
+  static std::string JsonString(const std::string& value) {
+    std::string out = "\"";
+    for (char c : value) {
+      if (c == '"' || c == '\\') {
+        out += '\\';
+        out += c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        char escaped[8];
+        std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        out += escaped;
+      } else {
+        out += c;
+      }
+    }
+    return out + "\"";
+  }
+
+  static std::atomic<ChromeTraceWriter*> instance_;
+
+  std::FILE* const file_;
+  std::mutex mutex_;
+  std::vector<Event> events_;
+};
+
+std::atomic<ChromeTraceWriter*> ChromeTraceWriter::instance_{nullptr};
+constexpr int ChromeTraceWriter::kMaxTracks;
+
+// Feeds every completed operation into the latency statistics and, if
+// enabled, the machine-readable results output. May be shared by several
+// worker threads.
+class OperationRecorder {
+ public:
+  OperationRecorder(ResultsWriter* results_writer, TraceWriter* trace_writer)
+      : results_writer_(results_writer), trace_writer_(trace_writer) {}
+
+  void Record(const OperationRecord& record) {
+    ChromeTraceWriter::OperationSpan(record);
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.Record(record);
+    if (results_writer_) {
+      results_writer_->Write(record);
+    }
+  }
+
+  // Appends the issue of an operation to the --record trace, if any.
+  void RecordIssue(Operation operation, const std::string& path,
+                   const Payload* payload, int item_count) {
+    if (trace_writer_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      trace_writer_->Append(operation, path, payload, item_count);
+    }
+  }
+
+  // Appends the issue of a kBatchWrite of `batch` to the --record trace.
+  void RecordIssue(const std::string& path,
+                   const std::vector<const Payload*>& batch) {
+    if (trace_writer_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      trace_writer_->Append(Operation::kBatchWrite, path, batch);
+    }
+  }
+
+  void RecordHedge(bool won) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.RecordHedge(won);
+  }
+
+  // How long to wait for a read before hedging it: the steady-state p95 read
+  // latency once enough reads have completed to estimate it, and
+  // `kInitialHedgeDelay` until then.
+  std::chrono::steady_clock::duration HedgeDelay() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const LatencyHistogram* histogram =
+        stats_.histogram(Operation::kRead, LatencyPhase::kSteadyState);
+    if (!histogram || histogram->count() < kMinSamplesForHedgeDelay) {
+      return kInitialHedgeDelay;
+    }
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::nanoseconds(histogram->ValueAtPercentile(95)));
+  }
+
+  // Whether records are written out, and so whether it is worth computing
+  // fields, such as the payload size of reads, that only appear there.
+  bool writes_results() const { return results_writer_ != nullptr; }
+
+  // Must not be called while other threads may still be recording.
+  const OperationLatencyStats& stats() const { return stats_; }
+
+ private:
+  static constexpr uint64_t kMinSamplesForHedgeDelay = 20;
+  static constexpr std::chrono::seconds kInitialHedgeDelay{1};
+
+  std::mutex mutex_;
+  OperationLatencyStats stats_;
+  ResultsWriter* const results_writer_;
+  TraceWriter* const trace_writer_;
+};
+
+constexpr std::chrono::seconds OperationRecorder::kInitialHedgeDelay;
+
+struct OperationTiming {
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point end;
+  // Whether the client-side deadline expired before the operation completed.
+  bool timed_out = false;
+  int attempts = 1;
+  std::chrono::steady_clock::time_point first_attempt_end;
+
+  std::chrono::steady_clock::duration elapsed() const { return end - start; }
+};
+
+std::string FormattedElapsedTime(std::chrono::steady_clock::duration elapsed) {
+  std::chrono::duration<double> elapsed_seconds = elapsed;
+  std::ostringstream ss;
+  ss << std::fixed;
+  ss << std::setprecision(2);
+  ss << elapsed_seconds.count() << "s";
+  return ss.str();
+}
+
+// The resources used by the process at one point in time. Counters that the
+// platform does not report are -1: Windows does not count context switches
+// per process.
+struct ResourceUsage {
+  std::chrono::steady_clock::time_point time;
+  uint64_t rss_bytes = 0;
+  std::chrono::nanoseconds user_cpu{0};
+  std::chrono::nanoseconds system_cpu{0};
+  int64_t voluntary_context_switches = -1;
+  int64_t involuntary_context_switches = -1;
+  int thread_count = -1;
+
+  static ResourceUsage Current() {
+    ResourceUsage usage;
+    usage.time = std::chrono::steady_clock::now();
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                             sizeof(counters))) {
+      usage.rss_bytes = counters.WorkingSetSize;
+    }
+    FILETIME creation_time, exit_time, kernel_time, user_time;
+    if (GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time,
+                        &kernel_time, &user_time)) {
+      usage.user_cpu = FileTimeDuration(user_time);
+      usage.system_cpu = FileTimeDuration(kernel_time);
+    }
+    HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+    if (snapshot != INVALID_HANDLE_VALUE) {
+      DWORD process_id = GetCurrentProcessId();
+      THREADENTRY32 entry;
+      entry.dwSize = sizeof(entry);
+      usage.thread_count = 0;
+      for (BOOL found = Thread32First(snapshot, &entry); found;
+           found = Thread32Next(snapshot, &entry)) {
+        if (entry.th32OwnerProcessID == process_id) {
+          usage.thread_count++;
+        }
+      }
+      CloseHandle(snapshot);
+    }
+#else
+    struct rusage rusage;
+    if (getrusage(RUSAGE_SELF, &rusage) == 0) {
+      usage.user_cpu = TimevalDuration(rusage.ru_utime);
+      usage.system_cpu = TimevalDuration(rusage.ru_stime);
+      usage.voluntary_context_switches = rusage.ru_nvcsw;
+      usage.involuntary_context_switches = rusage.ru_nivcsw;
+    }
+#ifdef __APPLE__
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t info_count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+                  reinterpret_cast<task_info_t>(&info),
+                  &info_count) == KERN_SUCCESS) {
+      usage.rss_bytes = info.resident_size;
+    }
+    thread_act_array_t threads;
+    mach_msg_type_number_t thread_count = 0;
+    if (task_threads(mach_task_self(), &threads, &thread_count) ==
+        KERN_SUCCESS) {
+      usage.thread_count = static_cast<int>(thread_count);
+      for (mach_msg_type_number_t i = 0; i < thread_count; i++) {
+        mach_port_deallocate(mach_task_self(), threads[i]);
+      }
+      vm_deallocate(mach_task_self(), reinterpret_cast<vm_address_t>(threads),
+                    thread_count * sizeof(thread_act_t));
+    }
+#else
+    // /proc/self/status has the current RSS, which getrusage() does not.
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+      if (line.compare(0, 6, "VmRSS:") == 0) {
+        usage.rss_bytes = std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+      } else if (line.compare(0, 8, "Threads:") == 0) {
+        usage.thread_count = std::atoi(line.c_str() + 8);
+      }
+    }
+#endif
+#endif
+    return usage;
+  }
+
+ private:
+#ifdef _WIN32
+  // FILETIME durations are in units of 100ns.
+  static std::chrono::nanoseconds FileTimeDuration(const FILETIME& time) {
+    uint64_t ticks = (static_cast<uint64_t>(time.dwHighDateTime) << 32) |
+                     time.dwLowDateTime;
+    return std::chrono::nanoseconds(ticks * 100);
+  }
+#else
+  static std::chrono::nanoseconds TimevalDuration(const timeval& time) {
+    return std::chrono::seconds(time.tv_sec) +
+           std::chrono::microseconds(time.tv_usec);
+  }
+#endif
+};
+
+// Samples the `ResourceUsage` of the process every `interval` on a background
+// thread, from `Start()` until `Stop()`, and summarizes the samples. Each
+// sample is also written to the samples file, if any, in the results format,
+// timestamped on the same steady clock as the operation records so that the
+// two line up. Thread counts include the sampler's own thread, except in the
+// first and last samples.
+class ResourceSampler {
+ public:
+  // Returns null if the samples file cannot be opened. An empty `path` means
+  // samples are only summarized, and "-" means stdout.
+  static std::unique_ptr<ResourceSampler> Start(
+      std::chrono::steady_clock::duration interval, ResultsFormat format,
+      const std::string& path) {
+    std::FILE* file = nullptr;
+    if (path == "-") {
+      file = stdout;
+    } else if (!path.empty()) {
+      file = std::fopen(path.c_str(), "wb");
+      if (!file) {
+        return nullptr;
+      }
+    }
+    return std::unique_ptr<ResourceSampler>(
+        new ResourceSampler(interval, format, file));
+  }
+
+  ~ResourceSampler() {
+    Stop();
+    if (file_ && file_ != stdout) {
+      std::fclose(file_);
+    }
+  }
+
+  ResourceSampler(const ResourceSampler&) = delete;
+  ResourceSampler& operator=(const ResourceSampler&) = delete;
+
+  // Stops sampling after taking a final sample.
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stopped_) {
+        return;
+      }
+      stopped_ = true;
+    }
+    condition_.notify_one();
+    thread_.join();
+    Sample();
+  }
+
+  void LogSummary() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (samples_.empty()) {
+      return;
+    }
+    const ResourceUsage& first = samples_.front();
+    const ResourceUsage& last = samples_.back();
+    uint64_t peak_rss = 0;
+    int min_threads = first.thread_count;
+    int max_threads = first.thread_count;
+    for (const ResourceUsage& sample : samples_) {
+      peak_rss = std::max(peak_rss, sample.rss_bytes);
+      min_threads = std::min(min_threads, sample.thread_count);
+      max_threads = std::max(max_threads, sample.thread_count);
+    }
+    std::chrono::duration<double> elapsed = last.time - first.time;
+    std::chrono::duration<double> cpu =
+        (last.user_cpu - first.user_cpu) + (last.system_cpu - first.system_cpu);
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(1)
+       << (elapsed.count() > 0 ? 100 * cpu.count() / elapsed.count() : 0.0)
+       << "%";
+    Log("=======================================");
+    Log("Resource usage over ", FormattedElapsedTime(last.time - first.time),
+        " (", samples_.size(), " samples):");
+    Log("RSS ", FormattedMebibytes(first.rss_bytes), " -> ",
+        FormattedMebibytes(last.rss_bytes), ", peak sampled ",
+        FormattedMebibytes(peak_rss));
+    Log("CPU user ", FormattedElapsedTime(last.user_cpu - first.user_cpu),
+        ", system ", FormattedElapsedTime(last.system_cpu - first.system_cpu),
+        " (", ss.str(), " of one core)");
+    Log("Threads ", first.thread_count, " -> ", last.thread_count, ", min ",
+        min_threads, ", max ", max_threads);
+    if (last.voluntary_context_switches >= 0) {
+      Log("Context switches: ",
+          last.voluntary_context_switches - first.voluntary_context_switches,
+          " voluntary, ",
+          last.involuntary_context_switches -
+              first.involuntary_context_switches,
+          " involuntary");
+    }
+  }
+
+ private:
+  ResourceSampler(std::chrono::steady_clock::duration interval,
+                  ResultsFormat format, std::FILE* file)
+      : interval_(interval), format_(format), file_(file) {
+    if (file_ && format_ == ResultsFormat::kCsv) {
+      std::fputs(
+          "time_ns,rss_bytes,user_cpu_ns,system_cpu_ns,"
+          "voluntary_context_switches,involuntary_context_switches,threads\n",
+          file_);
+    }
+    Sample();
+    thread_ = std::thread([this]() { Run(); });
+  }
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto next = std::chrono::steady_clock::now() + interval_;
+    while (!condition_.wait_until(lock, next, [this]() { return stopped_; })) {
+      lock.unlock();
+      Sample();
+      lock.lock();
+      next += interval_;
+    }
+  }
+
+  void Sample() {
+    ResourceUsage usage = ResourceUsage::Current();
+    ChromeTraceWriter::Counter("RSS (MiB)", usage.time,
+                               usage.rss_bytes / (1024.0 * 1024.0));
+    ChromeTraceWriter::Counter("threads", usage.time, usage.thread_count);
+    if (file_) {
+      Write(usage);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    samples_.push_back(usage);
+  }
+
+  void Write(const ResourceUsage& usage) {
+    long long values[] = {
+        static_cast<long long>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                usage.time.time_since_epoch())
+                .count()),
+        static_cast<long long>(usage.rss_bytes),
+        static_cast<long long>(usage.user_cpu.count()),
+        static_cast<long long>(usage.system_cpu.count()),
+        static_cast<long long>(usage.voluntary_context_switches),
+        static_cast<long long>(usage.involuntary_context_switches),
+        static_cast<long long>(usage.thread_count)};
+    if (format_ == ResultsFormat::kCsv) {
+      std::fprintf(file_, "%lld,%lld,%lld,%lld,%lld,%lld,%lld\n", values[0],
+                   values[1], values[2], values[3], values[4], values[5],
+                   values[6]);
+    } else {
+      std::fprintf(file_,
+                   "{\"time_ns\":%lld,\"rss_bytes\":%lld,\"user_cpu_ns\":%lld,"
+                   "\"system_cpu_ns\":%lld,\"voluntary_context_switches\":%lld,"
+                   "\"involuntary_context_switches\":%lld,\"threads\":%lld}\n",
+                   values[0], values[1], values[2], values[3], values[4],
+                   values[5], values[6]);
+    }
+    std::fflush(file_);
+  }
+
+  const std::chrono::steady_clock::duration interval_;
+  const ResultsFormat format_;
+  std::FILE* const file_;
+  mutable std::mutex mutex_;
+  std::condition_variable condition_;
+  bool stopped_ = false;
+  std::vector<ResourceUsage> samples_;
+  std::thread thread_;
+};
+
+void LogDeadlineExceeded(const std::string& name,
+                         std::chrono::steady_clock::duration elapsed) {
+  Log(name, " FAILED in ", FormattedElapsedTime(elapsed),
+      ": client-side deadline exceeded");
+}
+
+void LogFutureResult(const FutureBase& future, const std::string& name,
+                     std::chrono::steady_clock::duration elapsed) {
+  std::string elapsed_time_str = FormattedElapsedTime(elapsed);
+  if (future.error() != Error::kErrorOk) {
+    Log(name, " FAILED in ", elapsed_time_str, ": ",
+        FirestoreErrorNameFromErrorCode(future.error()), " ",
+        future.error_message());
+  } else {
+    Log(name, " done in ", elapsed_time_str);
+  }
+}
+
+// Waits for `future` to complete, giving up after `deadline` unless it is
+// zero.
+OperationTiming AwaitCompletion(
+    FutureBase& future, const std::string& name,
+    std::chrono::steady_clock::duration deadline =
+        std::chrono::steady_clock::duration::zero()) {
+  Log(name, " start");
+  OperationTiming timing;
+  timing.start = std::chrono::steady_clock::now();
+  AwaitableFutureCompletion completion(future);
+  if (deadline > std::chrono::steady_clock::duration::zero()) {
+    timing.timed_out =
+        !completion.AwaitInvokedUntil(1, timing.start + deadline);
+  } else {
+    completion.AwaitInvoked();
+  }
+  timing.end = std::chrono::steady_clock::now();
+  if (timing.timed_out) {
+    LogDeadlineExceeded(name, timing.elapsed());
+  } else {
+    LogFutureResult(future, name, timing.elapsed());
+  }
+  return timing;
+}
+
+// Extracts the contents of the document into `data`: every field if `fields`
+// is empty, otherwise only the named fields that are present, retrieved one
+// at a time so that the rest of the document is never materialized. Returns
+// the approximate size of the extracted data and stores the heap allocations
+// made by the extraction in `allocations`.
+std::size_t ReadDocumentFields(const DocumentSnapshot& snapshot,
+                               const std::vector<std::string>& fields,
+                               MapFieldValue& data,
+                               AllocationCounts& allocations) {
+  AllocationCounts start = AllocationCounts::CurrentThread();
+  if (fields.empty()) {
+    data =
+        snapshot.GetData(DocumentSnapshot::ServerTimestampBehavior::kDefault);
+  } else {
+    for (const std::string& field : fields) {
+      FieldValue value = snapshot.Get(field);
+      if (value.is_valid()) {
+        data.emplace(field, std::move(value));
+      }
+    }
+  }
+  std::size_t size = ApproximateDocumentSize(data);
+  allocations = AllocationCounts::CurrentThread() - start;
+  return size;
+}
+
+// Logs the contents of the document and returns its approximate size.
+std::size_t LogDocumentSnapshot(const DocumentSnapshot* snapshot,
+                                const std::vector<std::string>& fields,
+                                AllocationCounts& allocations) {
+  MapFieldValue data;
+  std::size_t size = ReadDocumentFields(*snapshot, fields, data, allocations);
+  Log("Document num key/value pairs", fields.empty() ? "" : " requested",
+      ": ", data.size());
+  int entry_index = 0;
+  for (const MapFieldValue::value_type& entry : data) {
+    Log("Entry #", ++entry_index, ": ", entry.first, "=", entry.second);
+  }
+  return size;
+}
+
+OperationRecord MakeOperationRecord(Operation operation, uint64_t index,
+                                    const std::string& path,
+                                    const OperationTiming& timing,
+                                    const FutureBase& future) {
+  OperationRecord record;
+  record.operation = operation;
+  record.index = index;
+  record.doc_path = path;
+  record.start = timing.start;
+  record.end = timing.end;
+  record.error =
+      timing.timed_out ? Error::kErrorDeadlineExceeded : future.error();
+  record.attempts = timing.attempts;
+  record.first_attempt_end =
+      timing.attempts > 1 ? timing.first_attempt_end : timing.end;
+  return record;
+}
+
+OperationRecord MakeOperationRecord(Operation operation, uint64_t index,
+                                    const DocumentReference& doc,
+                                    const OperationTiming& timing,
+                                    const FutureBase& future) {
+  return MakeOperationRecord(operation, index, doc.path(), timing, future);
+}
+
+Future<DocumentSnapshot> StartRead(DocumentReference doc,
+                                   Source source = Source::kServer) {
+  return doc.Get(source);
+}
+
+// Where the snapshot returned by a successfully completed read came from.
+DataOrigin DataOriginOfRead(const Future<DocumentSnapshot>& future) {
+  if (future.status() != FutureStatus::kFutureStatusComplete ||
+      future.error() != Error::kErrorOk) {
+    return DataOrigin::kNone;
+  }
+  return future.result()->metadata().is_from_cache() ? DataOrigin::kCache
+                                                     : DataOrigin::kServer;
+}
+
+Future<void> StartWrite(DocumentReference doc, const Payload& payload) {
+  return doc.Set(payload.data);
+}
+
+// Starts a WriteBatch that sets `doc` to each of `payloads` in turn.
+Future<void> StartBatchWrite(Firestore* firestore, DocumentReference doc,
+                             const std::vector<const Payload*>& payloads) {
+  WriteBatch batch = firestore->batch();
+  for (const Payload* payload : payloads) {
+    batch.Set(doc, payload->data);
+  }
+  return batch.Commit();
+}
+
+// The field incremented by kTransaction and kIncrement operations.
+constexpr char kCounterField[] = "Counter";
+
+DocumentReference ChooseHotDocument(Firestore* firestore, int hot_documents) {
+  thread_local std::mt19937_64 rng{std::random_device()()};
+  int key = std::uniform_int_distribution<int>(0, hot_documents - 1)(rng);
+  return firestore->Document("UnityIssue1154TestApp/HotDoc" +
+                             std::to_string(key));
+}
+
+// Increments the counter in `doc` in a read-modify-write transaction, counting
+// each run of the update function in `attempts`.
+Future<void> StartTransaction(Firestore* firestore, DocumentReference doc,
+                              std::shared_ptr<std::atomic<int>> attempts) {
+  return firestore->RunTransaction(
+      [doc, attempts](Transaction& transaction,
+                      std::string& error_message) -> Error {
+        (*attempts)++;
+        Error error = Error::kErrorOk;
+        DocumentSnapshot snapshot =
+            transaction.Get(doc, &error, &error_message);
+        if (error != Error::kErrorOk) {
+          return error;
+        }
+        FieldValue counter = snapshot.Get(kCounterField);
+        int64_t value = counter.is_integer() ? counter.integer_value() : 0;
+        transaction.Set(doc,
+                        MapFieldValue{{kCounterField,
+                                       FieldValue::Integer(value + 1)}},
+                        SetOptions::Merge());
+        return Error::kErrorOk;
+      });
+}
+
+Future<void> StartIncrement(DocumentReference doc) {
+  return doc.Set(MapFieldValue{{kCounterField, FieldValue::Increment(1)}},
+                 SetOptions::Merge());
+}
+
+std::size_t TotalPayloadSize(const std::vector<const Payload*>& payloads) {
+  std::size_t size = 0;
+  for (const Payload* payload : payloads) {
+    size += payload->size;
+  }
+  return size;
+}
+
+// Returns the number of operations, starting with `operation`, that are
+// performed together: the run of consecutive writes (capped at `batch_size`)
+// when batching is enabled, or 1 otherwise. The rest of the run is consumed
+// from `steps`.
+std::size_t TakeOperationGroup(Operation operation, WorkloadIterator& steps,
+                               int batch_size) {
+  std::size_t count = 1;
+  if (batch_size > 1 && operation == Operation::kWrite) {
+    WorkloadStep step;
+    while (count < static_cast<std::size_t>(batch_size) && steps.Peek(step) &&
+           !step.is_sleep && step.operation == Operation::kWrite) {
+      steps.Next(step);
+      count++;
+    }
+  }
+  return count;
+}
+
+void Sleep(std::chrono::steady_clock::duration duration) {
+  Log("Sleeping for ", FormattedElapsedTime(duration));
+  std::this_thread::sleep_for(duration);
+}
+
+// Runs `start()` and waits for the future it returns, repeating it after a
+// jittered exponential backoff while `policy.retry` allows. Each attempt gets
+// its own `deadline`; the returned timing spans all of them, and `future` is
+// left holding the last attempt.
+template <typename T>
+OperationTiming AwaitWithRetries(const std::function<Future<T>()>& start,
+                                 Future<T>& future, const std::string& name,
+                                 const RetryPolicy& policy,
+                                 std::chrono::steady_clock::duration deadline) {
+  thread_local std::mt19937_64 rng{std::random_device()()};
+  future = start();
+  OperationTiming timing = AwaitCompletion(future, name, deadline);
+  timing.first_attempt_end = timing.end;
+  auto first_start = timing.start;
+  auto backoff = std::min(policy.initial_backoff, policy.max_backoff);
+  for (int attempts = 1; attempts < policy.max_attempts; attempts++) {
+    Error error = timing.timed_out ? Error::kErrorDeadlineExceeded
+                                   : static_cast<Error>(future.error());
+    if (error == Error::kErrorOk || !policy.IsRetryable(error)) {
+      break;
+    }
+    std::uniform_int_distribution<std::chrono::steady_clock::rep> jitter(
+        0, backoff.count());
+    auto delay = std::chrono::steady_clock::duration(jitter(rng));
+    Log(name, " attempt ", attempts, " failed with ",
+        FirestoreErrorNameFromErrorCode(error), "; retrying in ",
+        FormattedElapsedTime(delay));
+    std::this_thread::sleep_for(delay);
+    backoff = std::min(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            backoff * policy.multiplier),
+        policy.max_backoff);
+
+    auto first_attempt_end = timing.first_attempt_end;
+    future = start();
+    timing = AwaitCompletion(future, name, deadline);
+    timing.start = first_start;
+    timing.first_attempt_end = first_attempt_end;
+    timing.attempts = attempts + 1;
+  }
+  return timing;
+}
+
+// Reads `doc` from the server; if that has not completed after
+// `recorder.HedgeDelay()`, also issues the hedge read chosen by `policy` and
+// returns whichever of the two succeeds first, or the original read if both
+// fail. `timing.timed_out` is set if neither completes within the deadline.
+Future<DocumentSnapshot> HedgedRead(DocumentReference doc,
+                                    const RequestPolicy& policy,
+                                    OperationRecorder& recorder,
+                                    OperationTiming& timing) {
+  const std::string name = "DocumentReference.Get()";
+  Log(name, " start");
+  timing.start = std::chrono::steady_clock::now();
+  auto deadline = std::chrono::steady_clock::time_point::max();
+  if (policy.deadline > std::chrono::steady_clock::duration::zero()) {
+    deadline = timing.start + policy.deadline;
+  }
+
+  std::vector<Future<DocumentSnapshot>> futures;
+  futures.push_back(StartRead(doc, SourceForReadMode(policy.read_mode)));
+  AwaitableFutureCompletion completion(futures[0]);
+  auto hedge_time = timing.start + recorder.HedgeDelay();
+  if (!completion.AwaitInvokedUntil(1, std::min(hedge_time, deadline)) &&
+      hedge_time < deadline) {
+    Log(name, " not done after ",
+        FormattedElapsedTime(hedge_time - timing.start), "; hedging with ",
+        policy.hedge == HedgeMode::kCache ? "Get(kCache)" : "Get(kServer)");
+    futures.push_back(doc.Get(policy.hedge == HedgeMode::kCache
+                                  ? Source::kCache
+                                  : Source::kServer));
+    completion.Add(futures[1]);
+  }
+
+  // Wait for the first successful read, or for every read to fail.
+  int winner = -1;
+  for (std::size_t completed = 1; winner < 0; completed++) {
+    if (deadline == std::chrono::steady_clock::time_point::max()) {
+      completion.AwaitInvoked(completed);
+    } else if (!completion.AwaitInvokedUntil(completed, deadline)) {
+      timing.timed_out = true;
+      break;
+    }
+    int index = completion.completion_order()[completed - 1];
+    if (futures[index].error() == Error::kErrorOk) {
+      winner = index;
+    } else if (completed == futures.size()) {
+      winner = 0;
+    }
+  }
+  timing.end = std::chrono::steady_clock::now();
+
+  if (futures.size() > 1) {
+    bool hedge_won = winner == 1 && futures[1].error() == Error::kErrorOk;
+    recorder.RecordHedge(hedge_won);
+    if (!timing.timed_out) {
+      Log(name, hedge_won ? " hedge won" : " original read won");
+    }
+  }
+  if (timing.timed_out) {
+    LogDeadlineExceeded(name, timing.elapsed());
+    return futures[0];
+  }
+  LogFutureResult(futures[winner], name, timing.elapsed());
+  return futures[winner];
+}
+
+void DoRead(DocumentReference doc, const RequestPolicy& policy,
+            OperationRecorder& recorder, uint64_t index) {
+  Log("=======================================");
+  Log("DoRead() doc=", doc.path());
+  recorder.RecordIssue(Operation::kRead, doc.path(), nullptr, 1);
+  Future<DocumentSnapshot> future;
+  OperationTiming timing;
+  if (policy.hedge != HedgeMode::kNone) {
+    future = HedgedRead(doc, policy, recorder, timing);
+  } else if (policy.read_mode == ReadMode::kMixed) {
+    future = StartRead(doc, Source::kCache);
+    timing = AwaitCompletion(future, "DocumentReference.Get(kCache)",
+                             policy.deadline);
+    timing.first_attempt_end = timing.end;
+    if (!timing.timed_out && (future.error() != Error::kErrorOk ||
+                              !future.result()->exists())) {
+      // Cache miss: the record covers both the cache and server attempts.
+      auto remaining = policy.deadline;
+      if (remaining > std::chrono::steady_clock::duration::zero()) {
+        remaining = std::max(remaining - timing.elapsed(),
+                             std::chrono::steady_clock::duration(1));
+      }
+      auto start = timing.start;
+      auto first_attempt_end = timing.first_attempt_end;
+      timing = AwaitWithRetries<DocumentSnapshot>(
+          [doc] { return StartRead(doc, Source::kServer); }, future,
+          "DocumentReference.Get(kServer)", policy.retry, remaining);
+      timing.start = start;
+      timing.first_attempt_end = first_attempt_end;
+    }
+  } else {
+    Source source = SourceForReadMode(policy.read_mode);
+    timing = AwaitWithRetries<DocumentSnapshot>(
+        [doc, source] { return StartRead(doc, source); }, future,
+        "DocumentReference.Get()", policy.retry, policy.deadline);
+  }
+  OperationRecord record =
+      MakeOperationRecord(Operation::kRead, index, doc, timing, future);
+  if (!timing.timed_out) {
+    record.origin = DataOriginOfRead(future);
+    record.payload_bytes = LogDocumentSnapshot(
+        future.result(), policy.fields, record.result_allocations);
+    record.result_extracted = true;
+  }
+  recorder.Record(record);
+}
+
+void DoWrite(DocumentReference doc, const Payload& payload,
+             const RequestPolicy& policy, OperationRecorder& recorder,
+             uint64_t index) {
+  Log("=======================================");
+  Log("DoWrite() doc=", doc.path(), " setting ", payload.description);
+  recorder.RecordIssue(Operation::kWrite, doc.path(), &payload, 1);
+  Future<void> future;
+  auto timing = AwaitWithRetries<void>(
+      [doc, &payload] { return StartWrite(doc, payload); }, future,
+      "DocumentReference.Set()", policy.retry, policy.deadline);
+  OperationRecord record =
+      MakeOperationRecord(Operation::kWrite, index, doc, timing, future);
+  record.payload_bytes = payload.size;
+  recorder.Record(record);
+}
+
+void DoBatchWrite(Firestore* firestore, DocumentReference doc,
+                  PayloadGenerator& payloads, int write_count,
+                  const RequestPolicy& policy, OperationRecorder& recorder,
+                  uint64_t index) {
+  Log("=======================================");
+  Log("DoBatchWrite() doc=", doc.path(), " setting ", payloads.description(),
+      " in ", write_count, " writes");
+  std::vector<const Payload*> batch = payloads.Next(write_count);
+  recorder.RecordIssue(doc.path(), batch);
+  Future<void> future;
+  auto timing = AwaitWithRetries<void>(
+      [firestore, doc, &batch] {
+        return StartBatchWrite(firestore, doc, batch);
+      },
+      future, "WriteBatch.Commit()", policy.retry, policy.deadline);
+  OperationRecord record =
+      MakeOperationRecord(Operation::kBatchWrite, index, doc, timing, future);
+  record.payload_bytes = TotalPayloadSize(batch);
+  record.item_count = write_count;
+  recorder.Record(record);
+  Log("WriteBatch.Commit() amortized ",
+      FormattedElapsedTime(timing.elapsed() / write_count), " per write");
+}
+
+void DoTransaction(Firestore* firestore, const RequestPolicy& policy,
+                   OperationRecorder& recorder, uint64_t index) {
+  DocumentReference doc = ChooseHotDocument(firestore, policy.hot_documents);
+  Log("=======================================");
+  Log("DoTransaction() doc=", doc.path());
+  recorder.RecordIssue(Operation::kTransaction, doc.path(), nullptr, 1);
+  auto attempts = std::make_shared<std::atomic<int>>(0);
+  Future<void> future;
+  auto timing = AwaitWithRetries<void>(
+      [firestore, doc, attempts] {
+        return StartTransaction(firestore, doc, attempts);
+      },
+      future, "Firestore.RunTransaction()", policy.retry, policy.deadline);
+  OperationRecord record =
+      MakeOperationRecord(Operation::kTransaction, index, doc, timing, future);
+  record.transaction_attempts = *attempts;
+  recorder.Record(record);
+  if (*attempts > 1) {
+    Log("Firestore.RunTransaction() ran the update function ", *attempts,
+        " times");
+  }
+}
+
+void DoIncrement(Firestore* firestore, const RequestPolicy& policy,
+                 OperationRecorder& recorder, uint64_t index) {
+  DocumentReference doc = ChooseHotDocument(firestore, policy.hot_documents);
+  Log("=======================================");
+  Log("DoIncrement() doc=", doc.path());
+  recorder.RecordIssue(Operation::kIncrement, doc.path(), nullptr, 1);
+  Future<void> future;
+  auto timing = AwaitWithRetries<void>(
+      [doc] { return StartIncrement(doc); }, future,
+      "DocumentReference.Set(Increment)", policy.retry, policy.deadline);
+  recorder.Record(
+      MakeOperationRecord(Operation::kIncrement, index, doc, timing, future));
+}
+
+// Reads the UnityIssue1154TestApp collection in pages of `policy.page_size`
+// documents, each requested with StartAfter() the last document of the
+// previous page, until a short page or `policy.max_pages`. Each page is
+// processed and released before the next is requested, so memory use is
+// bounded by the page size however large the collection is. Each page is
+// recorded as a kQuery operation of that many documents.
+void DoQuery(Firestore* firestore, const RequestPolicy& policy,
+             OperationRecorder& recorder, uint64_t index) {
+  CollectionReference collection =
+      firestore->Collection("UnityIssue1154TestApp");
+  Log("=======================================");
+  Log("DoQuery() collection=", collection.path(), " in pages of ",
+      policy.page_size, " documents");
+  const Source source = SourceForReadMode(policy.read_mode);
+  auto start = std::chrono::steady_clock::now();
+  Query query = collection.Limit(policy.page_size);
+  uint64_t document_count = 0;
+  uint64_t byte_count = 0;
+  int page_count = 0;
+  bool last_page = false;
+  while (!last_page &&
+         (policy.max_pages == 0 || page_count < policy.max_pages)) {
+    page_count++;
+    Future<QuerySnapshot> future;
+    auto timing = AwaitWithRetries<QuerySnapshot>(
+        [query, source] { return query.Get(source); }, future,
+        "Query.Get() of page " + std::to_string(page_count), policy.retry,
+        policy.deadline);
+    OperationRecord record = MakeOperationRecord(
+        Operation::kQuery, index, collection.path(), timing, future);
+    record.page = page_count - 1;
+    record.item_count = 0;
+    last_page = true;
+    if (record.error == Error::kErrorOk) {
+      std::vector<DocumentSnapshot> documents = future.result()->documents();
+      MapFieldValue data;
+      for (const DocumentSnapshot& document : documents) {
+        AllocationCounts allocations;
+        data.clear();
+        record.payload_bytes +=
+            ReadDocumentFields(document, policy.fields, data, allocations);
+      }
+      record.item_count = static_cast<int>(documents.size());
+      if (record.item_count == policy.page_size) {
+        query = collection.Limit(policy.page_size).StartAfter(documents.back());
+        last_page = false;
+      }
+    }
+    document_count += record.item_count;
+    byte_count += record.payload_bytes;
+    recorder.Record(record);
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed_seconds = end - start;
+  std::ostringstream ss;
+  ss << std::fixed << std::setprecision(2)
+     << document_count / elapsed_seconds.count() << " docs/s, "
+     << byte_count / elapsed_seconds.count() << " bytes/s";
+  Log("DoQuery() read ", document_count, " documents (", byte_count,
+      " bytes) in ", page_count, " pages in ",
+      FormattedElapsedTime(end - start), " (",
+      ss.str(), "); peak RSS ", FormattedMebibytes(PeakResidentSetBytes()));
+}
+
+// What RecordAwaitedWrites() found across the writes it recorded.
+struct AwaitedWrites {
+  // The first error of any write, which fails the whole operation.
+  int error = Error::kErrorOk;
+  std::size_t payload_bytes = 0;
+};
+
+// Records each of `futures`, writes of `docs` started at `start` and awaited
+// through `completion` until `end`, as a `kind` that ends when that write
+// completed, or times out at `end` if it had not.
+AwaitedWrites RecordAwaitedWrites(
+    const AwaitableFutureCompletion& completion,
+    const std::vector<DocumentReference>& docs,
+    const std::vector<Future<void>>& futures,
+    const std::vector<std::size_t>& payload_bytes,
+    std::chrono::steady_clock::time_point start,
+    std::chrono::steady_clock::time_point end, Operation kind, uint64_t index,
+    OperationRecorder& recorder) {
+  std::vector<int> order = completion.completion_order();
+  std::vector<std::chrono::steady_clock::time_point> times =
+      completion.completion_times();
+  std::vector<std::chrono::steady_clock::time_point> ends(futures.size(), end);
+  std::vector<bool> timed_out(futures.size(), true);
+  for (std::size_t i = 0; i < order.size(); i++) {
+    ends[order[i]] = times[i];
+    timed_out[order[i]] = false;
+  }
+  AwaitedWrites writes;
+  for (std::size_t i = 0; i < futures.size(); i++) {
+    OperationTiming timing;
+    timing.start = start;
+    timing.end = ends[i];
+    timing.timed_out = timed_out[i];
+    OperationRecord record =
+        MakeOperationRecord(kind, index, docs[i], timing, futures[i]);
+    record.payload_bytes = payload_bytes[i];
+    recorder.Record(record);
+    if (writes.error == Error::kErrorOk) {
+      writes.error = record.error;
+    }
+    writes.payload_bytes += record.payload_bytes;
+  }
+  return writes;
+}
+
+// Writes `fanout` distinct documents at once and waits for all of them, as a
+// save that touches several documents does. Each write is recorded as a
+// kFanOutDocument, and the whole as a kFanOut whose latency is that of the
+// slowest write, which is what the caller actually waits for.
+void DoFanOutWrite(Firestore* firestore, PayloadGenerator& payloads,
+                   int fanout, const RequestPolicy& policy,
+                   OperationRecorder& recorder, uint64_t index) {
+  using Clock = std::chrono::steady_clock;
+  Log("=======================================");
+  Log("DoFanOutWrite() writing ", fanout, " documents setting ",
+      payloads.description());
+  std::vector<DocumentReference> docs;
+  std::vector<Future<void>> futures;
+  std::vector<std::size_t> payload_bytes;
+  AwaitableFutureCompletion completion;
+  Log("DocumentReference.Set() of ", fanout, " documents start");
+  auto start = Clock::now();
+  for (int i = 0; i < fanout; i++) {
+    docs.push_back(firestore->Document("UnityIssue1154TestApp/FanOut" +
+                                       std::to_string(i)));
+    const Payload& payload = payloads.Next();
+    recorder.RecordIssue(Operation::kWrite, docs.back().path(), &payload, 1);
+    futures.push_back(StartWrite(docs.back(), payload));
+    payload_bytes.push_back(payload.size);
+    completion.Add(futures.back());
+  }
+  bool completed = true;
+  if (policy.deadline > Clock::duration::zero()) {
+    completed = completion.AwaitInvokedUntil(futures.size(),
+                                             start + policy.deadline);
+  } else {
+    completion.AwaitInvoked(futures.size());
+  }
+  auto end = Clock::now();
+
+  std::vector<int> order = completion.completion_order();
+  std::vector<Clock::time_point> times = completion.completion_times();
+  AwaitedWrites writes =
+      RecordAwaitedWrites(completion, docs, futures, payload_bytes, start, end,
+                          Operation::kFanOutDocument, index, recorder);
+
+  OperationTiming timing;
+  timing.start = start;
+  timing.end = completed ? times.back() : end;
+  timing.timed_out = !completed;
+  int slowest = completed ? order.back() : 0;
+  if (completed) {
+    LogFutureResult(futures[slowest],
+                    "DocumentReference.Set() of " + std::to_string(fanout) +
+                        " documents",
+                    timing.elapsed());
+    Log("Slowest document ", docs[slowest].path(), " took ",
+        FormattedElapsedTime(timing.elapsed()), ", fastest ",
+        FormattedElapsedTime(times.front() - start));
+  } else {
+    LogDeadlineExceeded("DocumentReference.Set() of " +
+                            std::to_string(fanout) + " documents",
+                        timing.elapsed());
+  }
+  OperationRecord record = MakeOperationRecord(
+      Operation::kFanOut, index, "UnityIssue1154TestApp", timing,
+      futures[slowest]);
+  record.error =
+      timing.timed_out ? Error::kErrorDeadlineExceeded : writes.error;
+  record.payload_bytes = writes.payload_bytes;
+  record.item_count = fanout;
+  recorder.Record(record);
+}
+
+// Disables the network, queues `write_count` writes to distinct documents and
+// re-enables it, as when a player comes back online with saves pending. Each
+// write is recorded as a kDrainWrite and the whole as a kDrain, both measured
+// from re-enabling the network, and the Set() that queued it locally as a
+// kDrainEnqueue; the memory held while they were pending is logged.
+void DoDrain(Firestore* firestore, PayloadGenerator& payloads,
+             int write_count, const RequestPolicy& policy,
+             OperationRecorder& recorder, uint64_t index) {
+  using Clock = std::chrono::steady_clock;
+  Log("=======================================");
+  Log("DoDrain() queueing ", write_count, " writes setting ",
+      payloads.description());
+  uint64_t rss_before = ResourceUsage::Current().rss_bytes;
+  Future<void> disable_future = firestore->DisableNetwork();
+  OperationTiming disable_timing =
+      AwaitCompletion(disable_future, "Firestore.DisableNetwork()");
+  if (disable_future.error() != Error::kErrorOk) {
+    recorder.Record(MakeOperationRecord(Operation::kDrain, index,
+                                        "UnityIssue1154TestApp",
+                                        disable_timing, disable_future));
+    return;
+  }
+
+  std::vector<DocumentReference> docs;
+  std::vector<Future<void>> futures;
+  std::vector<std::size_t> payload_bytes;
+  AwaitableFutureCompletion completion;
+  LatencyHistogram enqueue_latencies;
+  std::vector<OperationTiming> enqueue_timings;
+  auto enqueue_start = Clock::now();
+  for (int i = 0; i < write_count; i++) {
+    docs.push_back(firestore->Document("UnityIssue1154TestApp/Offline" +
+                                       std::to_string(i)));
+    const Payload& payload = payloads.Next();
+    OperationTiming enqueue_timing;
+    enqueue_timing.start = Clock::now();
+    futures.push_back(StartWrite(docs.back(), payload));
+    enqueue_timing.end = Clock::now();
+    enqueue_latencies.Record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            enqueue_timing.elapsed()));
+    enqueue_timings.push_back(enqueue_timing);
+    payload_bytes.push_back(payload.size);
+    completion.Add(futures.back());
+  }
+  auto enqueue_end = Clock::now();
+  ChromeTraceWriter::Span("offline enqueue", "drain", enqueue_start,
+                          enqueue_end);
+  uint64_t rss_pending = ResourceUsage::Current().rss_bytes;
+  Log("Queued ", write_count, " writes offline in ",
+      FormattedMillis(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          enqueue_end - enqueue_start)
+                          .count()),
+      " ms (Set() p50 ",
+      FormattedMillis(enqueue_latencies.ValueAtPercentile(50)), " ms, p99 ",
+      FormattedMillis(enqueue_latencies.ValueAtPercentile(99)), " ms, max ",
+      FormattedMillis(enqueue_latencies.max()),
+      " ms); RSS with writes pending ", FormattedMebibytes(rss_pending), " (",
+      rss_pending >= rss_before ? "+" : "-",
+      FormattedMebibytes(rss_pending >= rss_before ? rss_pending - rss_before
+                                                   : rss_before - rss_pending),
+      ")");
+  // Recorded only now so that recording does not slow down the enqueueing.
+  for (std::size_t i = 0; i < enqueue_timings.size(); i++) {
+    OperationRecord record =
+        MakeOperationRecord(Operation::kDrainEnqueue, index, docs[i],
+                            enqueue_timings[i], futures[i]);
+    // Queued locally; whether the write succeeds is up to its kDrainWrite.
+    record.error = Error::kErrorOk;
+    record.payload_bytes = payload_bytes[i];
+    recorder.Record(record);
+  }
+
+  Log("Firestore.EnableNetwork() and drain of ", write_count,
+      " writes start");
+  auto start = Clock::now();
+  Future<void> enable_future = firestore->EnableNetwork();
+  bool completed = true;
+  if (policy.deadline > Clock::duration::zero()) {
+    completed = completion.AwaitInvokedUntil(futures.size(),
+                                             start + policy.deadline);
+  } else {
+    completion.AwaitInvoked(futures.size());
+  }
+  auto end = Clock::now();
+  ChromeTraceWriter::Span("drain", "drain", start, end);
+
+  std::vector<int> order = completion.completion_order();
+  std::vector<Clock::time_point> times = completion.completion_times();
+  AwaitedWrites writes =
+      RecordAwaitedWrites(completion, docs, futures, payload_bytes, start, end,
+                          Operation::kDrainWrite, index, recorder);
+
+  OperationTiming timing;
+  timing.start = start;
+  timing.end = completed ? times.back() : end;
+  timing.timed_out = !completed;
+  const std::string name =
+      "Drain of " + std::to_string(write_count) + " writes";
+  if (completed) {
+    LogFutureResult(futures[order.back()], name, timing.elapsed());
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(2)
+       << write_count /
+              std::chrono::duration<double>(timing.elapsed()).count()
+       << " writes/s";
+    Log("Drained ", write_count, " writes in ",
+        FormattedElapsedTime(timing.elapsed()), " (", ss.str(),
+        ", first acknowledged after ",
+        FormattedElapsedTime(times.front() - start), "); RSS after drain ",
+        FormattedMebibytes(ResourceUsage::Current().rss_bytes), ", peak RSS ",
+        FormattedMebibytes(PeakResidentSetBytes()));
+  } else {
+    LogDeadlineExceeded(name, timing.elapsed());
+  }
+  OperationRecord record = MakeOperationRecord(
+      Operation::kDrain, index, "UnityIssue1154TestApp", timing,
+      enable_future);
+  record.error =
+      timing.timed_out ? Error::kErrorDeadlineExceeded : writes.error;
+  record.payload_bytes = writes.payload_bytes;
+  record.item_count = write_count;
+  recorder.Record(record);
+}
+
+// Measures write-to-notification propagation latency: attaches
+// `listener_count` snapshot listeners to `doc`, waits for their initial
+// snapshots, then writes a unique value from a separate writer thread with
+// `DoWrite()` and records how long it takes until every listener has seen the
+// server-acknowledged change. The write itself is recorded as usual.
+void DoListen(DocumentReference doc, const std::string& key,
+              const std::string& value, int listener_count,
+              const RequestPolicy& policy, OperationRecorder& recorder,
+              uint64_t index) {
+  using Clock = std::chrono::steady_clock;
+  struct State {
+    std::mutex mutex;
+    std::condition_variable condition;
+    // Whether each listener has delivered its initial snapshot; with
+    // MetadataChanges::kInclude one listener can deliver several.
+    std::vector<bool> initial_snapshot_seen;
+    int initial_snapshot_count = 0;
+    Error error = Error::kErrorOk;
+    std::string expected_value;
+    Clock::time_point write_start;
+    // When each listener first saw the latency-compensated local change.
+    std::vector<Clock::time_point> local_event_times;
+    // When each listener saw the change acknowledged by the backend.
+    std::vector<Clock::time_point> notified_times;
+    int notified_count = 0;
+  };
+
+  Log("=======================================");
+  Log("DoListen() doc=", doc.path(), " with ", listener_count, " listeners");
+  auto state = std::make_shared<State>();
+  state->initial_snapshot_seen.resize(listener_count);
+  state->local_event_times.resize(listener_count);
+  state->notified_times.resize(listener_count);
+  std::vector<ListenerRegistration> registrations;
+  for (int i = 0; i < listener_count; i++) {
+    registrations.push_back(doc.AddSnapshotListener(
+        MetadataChanges::kInclude,
+        [state, key, i](const DocumentSnapshot& snapshot, Error error,
+                        const std::string&) {
+          auto now = Clock::now();
+          std::lock_guard<std::mutex> lock(state->mutex);
+          if (error != Error::kErrorOk) {
+            if (state->error == Error::kErrorOk) {
+              state->error = error;
+            }
+          } else if (state->expected_value.empty()) {
+            if (state->initial_snapshot_seen[i]) {
+              return;
+            }
+            state->initial_snapshot_seen[i] = true;
+            state->initial_snapshot_count++;
+          } else if (state->notified_times[i] == Clock::time_point()) {
+            FieldValue field = snapshot.Get(key);
+            if (field.type() != FieldValue::Type::kString ||
+                field.string_value() != state->expected_value) {
+              return;
+            }
+            if (snapshot.metadata().has_pending_writes()) {
+              if (state->local_event_times[i] == Clock::time_point()) {
+                state->local_event_times[i] = now;
+              }
+              return;
+            }
+            state->notified_times[i] = now;
+            state->notified_count++;
+          } else {
+            return;
+          }
+          state->condition.notify_all();
+        }));
+  }
+
+  const bool has_deadline = policy.deadline > Clock::duration::zero();
+  const auto deadline = Clock::now() + policy.deadline;
+  std::unique_lock<std::mutex> lock(state->mutex);
+  // Waits for `done` until the deadline, if any; returns whether it is done.
+  auto wait = [&](const std::function<bool()>& done) -> bool {
+    if (!has_deadline) {
+      state->condition.wait(lock, done);
+      return true;
+    }
+    return state->condition.wait_until(lock, deadline, done);
+  };
+  bool ready = wait([&]() {
+    return state->initial_snapshot_count >= listener_count ||
+           state->error != Error::kErrorOk;
+  });
+  std::thread writer;
+  if (ready && state->error == Error::kErrorOk) {
+    // A value that the initial snapshots cannot already contain.
+    state->expected_value =
+        value + " @" + std::to_string(Clock::now().time_since_epoch().count());
+    std::string expected_value = state->expected_value;
+    writer = std::thread([&, state, expected_value]() {
+      {
+        std::lock_guard<std::mutex> writer_lock(state->mutex);
+        state->write_start = Clock::now();
+      }
+      DoWrite(doc, MakeSingleFieldPayload(key, expected_value), policy,
+              recorder, index);
+    });
+    ready = wait([&]() {
+      return state->notified_count >= listener_count ||
+             state->error != Error::kErrorOk;
+    });
+  }
+  lock.unlock();
+  if (writer.joinable()) {
+    writer.join();
+  }
+  for (ListenerRegistration& registration : registrations) {
+    registration.Remove();
+  }
+
+  lock.lock();
+  OperationRecord record;
+  record.operation = Operation::kListen;
+  record.index = index;
+  record.doc_path = doc.path();
+  record.start = state->write_start;
+  record.end = state->write_start;
+  record.error = ready ? state->error : Error::kErrorDeadlineExceeded;
+  // What the listeners waited for, including its timestamp suffix; nothing if
+  // they were never ready for the write.
+  record.payload_bytes = state->expected_value.empty()
+                             ? 0
+                             : key.size() + state->expected_value.size();
+  record.item_count = listener_count;
+  if (record.error != Error::kErrorOk) {
+    if (record.start == Clock::time_point()) {
+      record.start = Clock::now();
+      record.end = record.start;
+    }
+    Log("DoListen() FAILED: ", FirestoreErrorNameFromErrorCode(record.error));
+    recorder.Record(record);
+    return;
+  }
+
+  auto first_local = Clock::time_point::max();
+  for (const auto& time : state->local_event_times) {
+    if (time != Clock::time_point()) {
+      first_local = std::min(first_local, time);
+    }
+  }
+  auto first_notified = *std::min_element(state->notified_times.begin(),
+                                          state->notified_times.end());
+  record.end = *std::max_element(state->notified_times.begin(),
+                                 state->notified_times.end());
+  if (first_local != Clock::time_point::max()) {
+    Log("Listeners saw the local change after ",
+        FormattedElapsedTime(first_local - record.start));
+  }
+  Log("Listeners saw the acknowledged change after ",
+      FormattedElapsedTime(first_notified - record.start), " (first) to ",
+      FormattedElapsedTime(record.end - record.start), " (last of ",
+      listener_count, ")");
+  recorder.Record(record);
+}
+
+// The durations of the phases of startup, each with its offset from the entry
+// to main(). Written as JSON with one phase per line so that profiles can be
+// diffed across runs and SDK versions.
+class StartupProfile {
+ public:
+  StartupProfile() : origin_(std::chrono::steady_clock::now()) {}
+
+  void Record(const std::string& name,
+              std::chrono::steady_clock::time_point start,
+              std::chrono::steady_clock::time_point end) {
+    Phase phase;
+    phase.name = name;
+    phase.start = start - origin_;
+    phase.duration = end - start;
+    phases_.push_back(phase);
+    ChromeTraceWriter::Span(name, "startup", start, end);
+  }
+
+  // Records a phase that was not measured directly but worked out from
+  // others, with the offset of the phase it was derived from.
+  void RecordDerived(const std::string& name,
+                     std::chrono::steady_clock::duration start,
+                     std::chrono::steady_clock::duration duration) {
+    Phase phase;
+    phase.name = name;
+    phase.start = start;
+    phase.duration = duration;
+    phase.derived = true;
+    phases_.push_back(phase);
+  }
+
+  std::chrono::steady_clock::duration StartOf(const std::string& name) const {
+    for (const Phase& phase : phases_) {
+      if (phase.name == name) {
+        return phase.start;
+      }
+    }
+    return std::chrono::steady_clock::duration::zero();
+  }
+
+  void LogPhases() const {
+    Log("Startup profile (milliseconds since main()):");
+    for (const Phase& phase : phases_) {
+      std::ostringstream ss;
+      ss << "  " << std::left << std::setw(32) << phase.name << std::right
+         << std::fixed << std::setprecision(3) << std::setw(12)
+         << Millis(phase.duration) << " at " << std::setw(12)
+         << Millis(phase.start) << (phase.derived ? " (estimated)" : "");
+      Log(ss.str());
+    }
+  }
+
+  // Writes the profile to `path`, or to stdout if `path` is "-". Returns
+  // whether it was written successfully.
+  bool WriteJson(const std::string& path) const {
+    std::ostringstream ss;
+    ss << "{\"sdk_version\":\"" << SdkVersion() << "\",\"phases\":[\n";
+    for (std::size_t i = 0; i < phases_.size(); i++) {
+      const Phase& phase = phases_[i];
+      ss << std::fixed << std::setprecision(3) << "{\"name\":\"" << phase.name
+         << "\",\"start_ms\":" << Millis(phase.start)
+         << ",\"duration_ms\":" << Millis(phase.duration)
+         << ",\"derived\":" << (phase.derived ? "true" : "false") << "}"
+         << (i + 1 < phases_.size() ? "," : "") << "\n";
+    }
+    ss << "]}\n";
+    if (path == "-") {
+      std::cout << ss.str() << std::flush;
+      return static_cast<bool>(std::cout);
+    }
+    std::ofstream file(path);
+    file << ss.str();
+    file.close();
+    return !file.fail();
+  }
+
+ private:
+  struct Phase {
+    std::string name;
+    std::chrono::steady_clock::duration start;
+    std::chrono::steady_clock::duration duration;
+    bool derived = false;
+  };
+
+  static double Millis(std::chrono::steady_clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+  }
+
+  static const char* SdkVersion() {
+#ifdef FIREBASE_VERSION_NUMBER_STRING
+    return FIREBASE_VERSION_NUMBER_STRING;
+#else
+    return "unknown";
+#endif
+  }
+
+  const std::chrono::steady_clock::time_point origin_;
+  std::vector<Phase> phases_;
+};
+
+// Profiles the startup work that the SDK defers until the first operations:
+// the first auth token (if a user is signed in), opening the local store with
+// a cache-only read, and the first two server reads. The public API exposes
+// neither the gRPC channel nor the token exchange with the backend, so their
+// combined cost is estimated as the first server read's latency in excess of
+// the second's, which runs over the established channel.
+void ProfileFirstOperations(Auth* auth, Firestore* firestore,
+                            StartupProfile& profile) {
+  Log("=======================================");
+  User* user = auth ? auth->current_user() : nullptr;
+  if (user) {
+    Future<std::string> token_future = user->GetToken(false);
+    auto timing = AwaitCompletion(token_future, "User.GetToken()");
+    profile.Record("first_auth_token", timing.start, timing.end);
+  } else {
+    Log("No signed-in user; skipping the first auth token");
+  }
+
+  DocumentReference doc = firestore->Document("UnityIssue1154TestApp/WarmUp");
+  Future<DocumentSnapshot> cache_future = doc.Get(Source::kCache);
+  auto cache_timing =
+      AwaitCompletion(cache_future, "Startup DocumentReference.Get(kCache)");
+  profile.Record("local_store_open", cache_timing.start, cache_timing.end);
+
+  Future<DocumentSnapshot> first_future = doc.Get(Source::kServer);
+  auto first_timing = AwaitCompletion(
+      first_future, "Startup first DocumentReference.Get(kServer)");
+  profile.Record("first_rpc", first_timing.start, first_timing.end);
+
+  Future<DocumentSnapshot> second_future = doc.Get(Source::kServer);
+  auto second_timing = AwaitCompletion(
+      second_future, "Startup second DocumentReference.Get(kServer)");
+  profile.Record("second_rpc", second_timing.start, second_timing.end);
+
+  if (first_future.error() == Error::kErrorOk &&
+      second_future.error() == Error::kErrorOk) {
+    profile.RecordDerived(
+        "channel_and_auth_setup", profile.StartOf("first_rpc"),
+        std::max(first_timing.elapsed() - second_timing.elapsed(),
+                 std::chrono::steady_clock::duration::zero()));
+  }
+}
+
+// Forces the backend connection (gRPC channel and auth handshake) to be
+// established before any user-visible operation is issued. A cache-only read
+// first brings up the local store without touching the network; then a write
+// to a scratch document opens the connection, since writes tolerate a much
+// longer initial connection than the 10-second deadline of server reads; and
+// finally a server read probes the latency of the now-established connection.
+void WarmUpConnection(Firestore* firestore) {
+  Log("=======================================");
+  DocumentReference doc = firestore->Document("UnityIssue1154TestApp/WarmUp");
+  Log("WarmUpConnection() doc=", doc.path());
+  auto start = std::chrono::steady_clock::now();
+
+  Future<DocumentSnapshot> cache_future = doc.Get(Source::kCache);
+  auto cache_timing =
+      AwaitCompletion(cache_future, "Warm-up DocumentReference.Get(kCache)");
+
+  MapFieldValue map;
+  map["WarmUpTimestamp"] = FieldValue::ServerTimestamp();
+  Future<void> write_future = doc.Set(map);
+  auto connect_timing =
+      AwaitCompletion(write_future, "Warm-up DocumentReference.Set()");
+
+  Future<DocumentSnapshot> probe_future = doc.Get(Source::kServer);
+  auto probe_timing =
+      AwaitCompletion(probe_future, "Warm-up DocumentReference.Get(kServer)");
+
+  auto end = std::chrono::steady_clock::now();
+  ChromeTraceWriter::Span("warm-up", "warmup", start, end);
+  ChromeTraceWriter::Span("warm-up local cache", "warmup", cache_timing.start,
+                          cache_timing.end);
+  ChromeTraceWriter::Span("warm-up connection setup", "warmup",
+                          connect_timing.start, connect_timing.end);
+  ChromeTraceWriter::Span("warm-up server probe", "warmup",
+                          probe_timing.start, probe_timing.end);
+  Log("Connection warm-up ",
+      write_future.error() == Error::kErrorOk ? "done" : "FAILED", " in ",
+      FormattedElapsedTime(end - start),
+      " (local cache: ", FormattedElapsedTime(cache_timing.elapsed()),
+      ", connection setup: ", FormattedElapsedTime(connect_timing.elapsed()),
+      ", server probe: ", FormattedElapsedTime(probe_timing.elapsed()), ")");
+}
+
+// Runs a list of operations keeping up to `concurrency` of them in flight at
+// once. Completions are delivered from the Firestore callback threads into a
+// queue that is drained by the thread that called `Run()`, which logs the
+// result and immediately issues the next pending operation into the freed slot.
+class OperationPipeline {
+ public:
+  OperationPipeline(Firestore* firestore, DocumentReference doc,
+                    PayloadGenerator& payloads, int concurrency,
+                    int batch_size, RequestPolicy policy,
+                    OperationRecorder& recorder)
+      : firestore_(firestore),
+        doc_(doc),
+        payloads_(payloads),
+        batch_size_(batch_size),
+        policy_(std::move(policy)),
+        recorder_(recorder),
+        slots_(concurrency) {}
+
+  // Runs the operations of `workload`; a sleep step pauses the issuing of
+  // further operations while those in flight continue.
+  void Run(const WorkloadSpec& workload) {
+    Log("Running ", workload.operation_count(), " operations with up to ",
+        slots_.size(), " in flight");
+    auto start = std::chrono::steady_clock::now();
+    WorkloadIterator steps(workload);
+    std::size_t next_operation = 0;
+    std::size_t in_flight = 0;
+
+    for (std::size_t i = 0; i < slots_.size(); i++) {
+      slots_[i].pipeline = this;
+      if (!Issue(slots_[i], steps, next_operation)) {
+        break;
+      }
+      in_flight++;
+    }
+
+    while (in_flight > 0) {
+      Slot& slot = slots_[AwaitNextCompletedSlot()];
+      in_flight--;
+      Finish(slot);
+      if (Issue(slot, steps, next_operation)) {
+        in_flight++;
+      }
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end - start;
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(2)
+       << (elapsed_seconds.count() > 0
+               ? next_operation / elapsed_seconds.count()
+               : 0.0);
+    Log("Completed ", next_operation, " operations in ",
+        FormattedElapsedTime(end - start), " (", ss.str(), " ops/s)");
+  }
+
+ private:
+  struct Slot {
+    OperationPipeline* pipeline = nullptr;
+    std::size_t index = 0;
+    Operation operation = Operation::kRead;
+    int write_count = 1;
+    std::size_t payload_bytes = 0;
+    // `doc_`, or the hot document of a kTransaction or kIncrement.
+    DocumentReference doc;
+    FutureBase future;
+    Future<DocumentSnapshot> read_future;
+    std::shared_ptr<std::atomic<int>> transaction_attempts;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+  };
+
+  // Issues the next operation (or batch of writes) from `steps` into `slot`,
+  // advancing `index` past the operations it covers. Returns false if there
+  // are no operations left.
+  bool Issue(Slot& slot, WorkloadIterator& steps, std::size_t& index) {
+    WorkloadStep step;
+    while (true) {
+      if (!steps.Next(step)) {
+        return false;
+      } else if (!step.is_sleep) {
+        break;
+      }
+      Sleep(step.sleep);
+    }
+    std::size_t group_size =
+        TakeOperationGroup(step.operation, steps, batch_size_);
+    slot.index = index;
+    index += group_size;
+    slot.operation =
+        group_size > 1 ? Operation::kBatchWrite : step.operation;
+    slot.write_count = static_cast<int>(group_size);
+    slot.doc = slot.operation == Operation::kTransaction ||
+                       slot.operation == Operation::kIncrement
+                   ? ChooseHotDocument(firestore_, policy_.hot_documents)
+                   : doc_;
+    Log(OperationName(slot), " start");
+    slot.start = std::chrono::steady_clock::now();
+    slot.read_future = Future<DocumentSnapshot>();
+    slot.transaction_attempts.reset();
+    slot.payload_bytes = 0;
+    switch (slot.operation) {
+      case Operation::kRead:
+        recorder_.RecordIssue(Operation::kRead, doc_.path(), nullptr, 1);
+        slot.read_future =
+            StartRead(doc_, SourceForReadMode(policy_.read_mode));
+        slot.future = slot.read_future;
+        break;
+      case Operation::kWrite: {
+        const Payload& payload = payloads_.Next();
+        recorder_.RecordIssue(Operation::kWrite, doc_.path(), &payload, 1);
+        slot.future = StartWrite(doc_, payload);
+        slot.payload_bytes = payload.size;
+        break;
+      }
+      case Operation::kBatchWrite: {
+        std::vector<const Payload*> batch = payloads_.Next(slot.write_count);
+        recorder_.RecordIssue(doc_.path(), batch);
+        slot.future = StartBatchWrite(firestore_, doc_, batch);
+        slot.payload_bytes = TotalPayloadSize(batch);
+        break;
+      }
+      case Operation::kListen:
+      case Operation::kQuery:
+      case Operation::kFanOut:
+      case Operation::kFanOutDocument:
+      case Operation::kDrain:
+      case Operation::kDrainWrite:
+      case Operation::kDrainEnqueue:
+        // Rejected by ParseArguments() in combination with --concurrency.
+        break;
+      case Operation::kTransaction:
+        recorder_.RecordIssue(Operation::kTransaction, slot.doc.path(),
+                              nullptr, 1);
+        slot.transaction_attempts = std::make_shared<std::atomic<int>>(0);
+        slot.future =
+            StartTransaction(firestore_, slot.doc, slot.transaction_attempts);
+        break;
+      case Operation::kIncrement:
+        recorder_.RecordIssue(Operation::kIncrement, slot.doc.path(), nullptr,
+                              1);
+        slot.future = StartIncrement(slot.doc);
+        break;
+    }
+    slot.future.OnCompletion(OnCompletion, &slot);
+    return true;
+  }
+
+  void Finish(Slot& slot) {
+    LogFutureResult(slot.future, OperationName(slot), slot.end - slot.start);
+    OperationTiming timing;
+    timing.start = slot.start;
+    timing.end = slot.end;
+    OperationRecord record = MakeOperationRecord(
+        slot.operation, slot.index, slot.doc, timing, slot.future);
+    record.item_count = slot.write_count;
+    if (slot.transaction_attempts) {
+      record.transaction_attempts = *slot.transaction_attempts;
+    }
+    if (slot.operation == Operation::kRead) {
+      if (slot.future.error() == Error::kErrorOk) {
+        record.payload_bytes =
+            LogDocumentSnapshot(slot.read_future.result(), policy_.fields,
+                                record.result_allocations);
+        record.result_extracted = true;
+      }
+      record.origin = DataOriginOfRead(slot.read_future);
+    } else {
+      record.payload_bytes = slot.payload_bytes;
+    }
+    recorder_.Record(record);
+  }
+
+  std::string OperationName(const Slot& slot) const {
+    std::ostringstream ss;
+    switch (slot.operation) {
+      case Operation::kRead:
+        ss << "DocumentReference.Get()";
+        break;
+      case Operation::kWrite:
+        ss << "DocumentReference.Set()";
+        break;
+      case Operation::kBatchWrite:
+        ss << "WriteBatch.Commit() of " << slot.write_count << " writes";
+        break;
+      case Operation::kListen:
+      case Operation::kQuery:
+      case Operation::kFanOut:
+      case Operation::kFanOutDocument:
+      case Operation::kDrain:
+      case Operation::kDrainWrite:
+      case Operation::kDrainEnqueue:
+        break;
+      case Operation::kTransaction:
+        ss << "Firestore.RunTransaction() on " << slot.doc.path();
+        break;
+      case Operation::kIncrement:
+        ss << "DocumentReference.Set(Increment) on " << slot.doc.path();
+        break;
+    }
+    ss << " #" << (slot.index + 1);
+    return ss.str();
+  }
+
+  static void OnCompletion(const FutureBase&, void* user_data) {
+    Slot* slot = static_cast<Slot*>(user_data);
+    slot->end = std::chrono::steady_clock::now();
+    OperationPipeline* pipeline = slot->pipeline;
+    std::unique_lock<std::mutex> lock(pipeline->mutex_);
+    pipeline->completed_slots_.push_back(slot - pipeline->slots_.data());
+    pipeline->condition_.notify_one();
+  }
+
+  std::size_t AwaitNextCompletedSlot() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    condition_.wait(lock, [this]() { return !completed_slots_.empty(); });
+    std::size_t slot_index = completed_slots_.front();
+    completed_slots_.pop_front();
+    return slot_index;
+  }
+
+  Firestore* const firestore_;
+  DocumentReference doc_;
+  PayloadGenerator& payloads_;
+  const int batch_size_;
+  const RequestPolicy policy_;
+  OperationRecorder& recorder_;
+  std::vector<Slot> slots_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::deque<std::size_t> completed_slots_;
+};
+
+// Runs `chain_count` copies of a list of operations at once, each as a chain
+// of `Async` continuations that issues an operation when the previous one in
+// the same chain completes. No thread waits on an operation, so however many
+// chains there are, they are multiplexed on the threads of one `Executor`.
+class OperationChains {
+ public:
+  OperationChains(Firestore* firestore, DocumentReference doc,
+                  PayloadGenerator& payloads, int chain_count,
+                  int executor_threads, int batch_size, RequestPolicy policy,
+                  OperationRecorder& recorder)
+      : firestore_(firestore),
+        doc_(doc),
+        payloads_(payloads),
+        chain_count_(chain_count),
+        batch_size_(batch_size),
+        policy_(std::move(policy)),
+        recorder_(recorder),
+        executor_(executor_threads) {}
+
+  void Run(const WorkloadSpec& workload) {
+    using Clock = std::chrono::steady_clock;
+    Log("Running ", chain_count_, " chains of ", workload.operation_count(),
+        " operations on ", executor_.thread_count(), " executor threads");
+    auto start = Clock::now();
+    std::vector<Async<Clock::time_point>> chains;
+    for (int i = 0; i < chain_count_; i++) {
+      auto chain = std::make_shared<Chain>(workload, executor_);
+      chains.push_back(chain->done);
+      executor_.Post([this, chain]() { Continue(chain); });
+    }
+    Async<std::size_t> first = WhenAny(executor_, chains);
+    std::vector<Clock::time_point> ends = WhenAll(executor_, chains).Wait();
+    auto end = Clock::now();
+
+    std::size_t operation_count = workload.operation_count() * chains.size();
+    std::chrono::duration<double> elapsed_seconds = end - start;
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(2)
+       << (elapsed_seconds.count() > 0
+               ? operation_count / elapsed_seconds.count()
+               : 0.0);
+    Log("Completed ", operation_count, " operations in ",
+        FormattedElapsedTime(end - start), " (", ss.str(),
+        " ops/s); first chain finished after ",
+        FormattedElapsedTime(ends[first.Wait()] - start));
+  }
+
+ private:
+  struct Chain {
+    Chain(const WorkloadSpec& workload, Executor& executor)
+        : steps(workload), done(executor) {}
+
+    WorkloadIterator steps;
+    // The index of the next operation within this chain.
+    std::size_t next_index = 0;
+    // Completes with the time the chain ran out of operations.
+    Async<std::chrono::steady_clock::time_point> done;
+  };
+
+  // Issues the next operation (or batch of writes) of `chain`, and continues
+  // with the one after it once it completes; sleep steps are delayed tasks
+  // rather than sleeping executor threads.
+  void Continue(std::shared_ptr<Chain> chain) {
+    WorkloadStep step;
+    if (!chain->steps.Next(step)) {
+      chain->done.Complete(std::chrono::steady_clock::now());
+      return;
+    } else if (step.is_sleep) {
+      executor_.PostAfter(step.sleep, [this, chain]() { Continue(chain); });
+      return;
+    }
+    std::size_t group_size =
+        TakeOperationGroup(step.operation, chain->steps, batch_size_);
+    std::size_t index = chain->next_index;
+    chain->next_index += group_size;
+    Operation operation =
+        group_size > 1 ? Operation::kBatchWrite : step.operation;
+    Issue(operation, index, static_cast<int>(group_size))
+        .OnComplete([this, chain](const OperationRecord& record) {
+          recorder_.Record(record);
+          Continue(chain);
+        });
+  }
+
+  Async<OperationRecord> Issue(Operation operation, std::size_t index,
+                               int write_count) {
+    auto start = std::chrono::steady_clock::now();
+    switch (operation) {
+      case Operation::kRead: {
+        recorder_.RecordIssue(Operation::kRead, doc_.path(), nullptr, 1);
+        Future<DocumentSnapshot> future =
+            StartRead(doc_, SourceForReadMode(policy_.read_mode));
+        return AsyncFromFuture(executor_, future)
+            .Then<OperationRecord>(
+                [this, index, start](
+                    const CompletedFuture<DocumentSnapshot>& completed) {
+                  OperationRecord record =
+                      Finish(Operation::kRead, doc_, index, 1, start,
+                             completed);
+                  if (completed.future.error() == Error::kErrorOk) {
+                    record.payload_bytes = LogDocumentSnapshot(
+                        completed.future.result(), policy_.fields,
+                        record.result_allocations);
+                    record.result_extracted = true;
+                  }
+                  record.origin = DataOriginOfRead(completed.future);
+                  return Async<OperationRecord>::Completed(executor_,
+                                                           record);
+                });
+      }
+      case Operation::kWrite:
+      case Operation::kBatchWrite: {
+        Future<void> future;
+        std::size_t payload_bytes = 0;
+        {
+          std::lock_guard<std::mutex> lock(payloads_mutex_);
+          std::vector<const Payload*> batch = payloads_.Next(write_count);
+          if (operation == Operation::kBatchWrite) {
+            recorder_.RecordIssue(doc_.path(), batch);
+          } else {
+            recorder_.RecordIssue(operation, doc_.path(), batch[0], 1);
+          }
+          future = operation == Operation::kWrite
+                       ? StartWrite(doc_, *batch[0])
+                       : StartBatchWrite(firestore_, doc_, batch);
+          payload_bytes = TotalPayloadSize(batch);
+        }
+        return AsyncFromFuture(executor_, future)
+            .Then<OperationRecord>([this, operation, index, write_count,
+                                    start, payload_bytes](
+                                       const CompletedFuture<void>& completed) {
+              OperationRecord record = Finish(operation, doc_, index,
+                                              write_count, start, completed);
+              record.payload_bytes = payload_bytes;
+              return Async<OperationRecord>::Completed(executor_, record);
+            });
+      }
+      case Operation::kListen:
+      case Operation::kQuery:
+      case Operation::kFanOut:
+      case Operation::kFanOutDocument:
+      case Operation::kDrain:
+      case Operation::kDrainWrite:
+      case Operation::kDrainEnqueue:
+        // Rejected by ParseArguments() in combination with --chains.
+        break;
+      case Operation::kTransaction:
+      case Operation::kIncrement: {
+        DocumentReference doc =
+            ChooseHotDocument(firestore_, policy_.hot_documents);
+        recorder_.RecordIssue(operation, doc.path(), nullptr, 1);
+        auto attempts = std::make_shared<std::atomic<int>>(0);
+        Future<void> future = operation == Operation::kTransaction
+                                  ? StartTransaction(firestore_, doc, attempts)
+                                  : StartIncrement(doc);
+        return AsyncFromFuture(executor_, future)
+            .Then<OperationRecord>(
+                [this, operation, index, start, doc,
+                 attempts](const CompletedFuture<void>& completed) {
+                  OperationRecord record =
+                      Finish(operation, doc, index, 1, start, completed);
+                  record.transaction_attempts = *attempts;
+                  return Async<OperationRecord>::Completed(executor_,
+                                                           record);
+                });
+      }
+    }
+    return Async<OperationRecord>::Completed(executor_, OperationRecord());
+  }
+
+  template <typename T>
+  OperationRecord Finish(Operation operation, const DocumentReference& doc,
+                         std::size_t index, int write_count,
+                         std::chrono::steady_clock::time_point start,
+                         const CompletedFuture<T>& completed) {
+    std::string name = OperationKindName(operation);
+    name += " #" + std::to_string(index + 1);
+    LogFutureResult(completed.future, name, completed.time - start);
+    OperationTiming timing;
+    timing.start = start;
+    timing.end = completed.time;
+    OperationRecord record =
+        MakeOperationRecord(operation, index, doc, timing, completed.future);
+    record.item_count = write_count;
+    return record;
+  }
+
+  Firestore* const firestore_;
+  DocumentReference doc_;
+  // Shared by the chains, which issue writes from every executor thread.
+  PayloadGenerator& payloads_;
+  std::mutex payloads_mutex_;
+  const int chain_count_;
+  const int batch_size_;
+  const RequestPolicy policy_;
+  OperationRecorder& recorder_;
+  // Declared last so that it is destroyed, draining its tasks, first.
+  Executor executor_;
+};
+
+std::string DocumentPathForKey(int key, int keyspace_size) {
+  std::string path = "UnityIssue1154TestApp/TestDoc";
+  if (keyspace_size > 1) {
+    path += std::to_string(key);
+  }
+  return path;
+}
+
+// Chooses document keys in `[0, keyspace_size)`, either uniformly or following
+// a zipf distribution in which key `k` has weight `1 / (k + 1)^exponent`.
+class KeyChooser {
+ public:
+  explicit KeyChooser(const LoadGeneratorOptions& options)
+      : keyspace_size_(options.keyspace_size) {
+    if (options.distribution == KeyDistribution::kZipf && keyspace_size_ > 1) {
+      cumulative_weights_.reserve(keyspace_size_);
+      double total_weight = 0;
+      for (int rank = 1; rank <= keyspace_size_; rank++) {
+        total_weight += 1.0 / std::pow(rank, options.zipf_exponent);
+        cumulative_weights_.push_back(total_weight);
+      }
+      for (double& weight : cumulative_weights_) {
+        weight /= total_weight;
+      }
+    }
+  }
+
+  int Choose(std::mt19937_64& rng) const {
+    if (cumulative_weights_.empty()) {
+      return std::uniform_int_distribution<int>(0, keyspace_size_ - 1)(rng);
+    }
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    auto it = std::lower_bound(cumulative_weights_.begin(),
+                               cumulative_weights_.end(), u);
+    int key = static_cast<int>(it - cumulative_weights_.begin());
+    return key < keyspace_size_ ? key : keyspace_size_ - 1;
+  }
+
+ private:
+  const int keyspace_size_;
+  std::vector<double> cumulative_weights_;
+};
+
+// One or more Firestore instances, each of its own App and so with its own
+// connection to the backend, between which documents are routed by a hash of
+// their path. The first shard is the instance the others were created beside.
+class FirestoreShards {
+ public:
+  explicit FirestoreShards(Firestore* firestore) : shards_{firestore} {}
+
+  FirestoreShards(const FirestoreShards&) = delete;
+  FirestoreShards& operator=(const FirestoreShards&) = delete;
+
+  void Add(std::unique_ptr<App> app, std::unique_ptr<Firestore> firestore) {
+    shards_.push_back(firestore.get());
+    apps_.push_back(std::move(app));
+    firestores_.push_back(std::move(firestore));
+  }
+
+  // A 32-bit FNV-1a hash of `path`, so that the routing of documents is the
+  // same from run to run and platform to platform.
+  std::size_t IndexForPath(const std::string& path) const {
+    uint32_t hash = 2166136261u;
+    for (char c : path) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return hash % shards_.size();
+  }
+
+  Firestore* ForPath(const std::string& path) const {
+    return shards_[IndexForPath(path)];
+  }
+
+  Firestore* shard(std::size_t index) const { return shards_[index]; }
+  std::size_t size() const { return shards_.size(); }
+
+ private:
+  std::vector<Firestore*> shards_;
+  // Destroyed before the Apps they belong to.
+  std::vector<std::unique_ptr<App>> apps_;
+  std::vector<std::unique_ptr<Firestore>> firestores_;
+};
+
+// Generates an open-loop load: operation `i` is scheduled at `i / rate` seconds
+// after the start and is issued at that time no matter how many earlier
+// operations are still in flight. Latency is measured from the scheduled time
+// rather than from the actual issue time so that any lag in the generator
+// itself is charged to the operation instead of being silently omitted.
+class LoadGenerator {
+ public:
+  LoadGenerator(const FirestoreShards& shards,
+                const LoadGeneratorOptions& options,
+                PayloadGenerator& payloads, RequestPolicy policy,
+                OperationRecorder& recorder)
+      : shards_(shards),
+        options_(options),
+        payloads_(&payloads),
+        trace_(nullptr),
+        speed_(1),
+        policy_(std::move(policy)),
+        recorder_(recorder),
+        key_chooser_(options),
+        rng_(std::random_device()()),
+        shard_latencies_(shards.size()) {}
+
+  // Replays the operations of `trace` at their recorded times, scaled by
+  // `1 / speed`.
+  LoadGenerator(const FirestoreShards& shards, const TraceReader& trace,
+                double speed, RequestPolicy policy,
+                OperationRecorder& recorder)
+      : shards_(shards),
+        payloads_(nullptr),
+        trace_(&trace),
+        speed_(speed),
+        policy_(std::move(policy)),
+        recorder_(recorder),
+        key_chooser_(options_),
+        rng_(std::random_device()()),
+        shard_latencies_(shards.size()) {}
+
+  void Run() {
+    Log("=======================================");
+    uint64_t total_operations = 0;
+    if (trace_) {
+      total_operations = trace_->record_count();
+      Log("Replaying ", total_operations, " operations at ", speed_,
+          "x the recorded speed");
+    } else {
+      total_operations = static_cast<uint64_t>(
+          std::max(1.0, std::round(options_.ops_per_second *
+                                   options_.duration_seconds)));
+      Log("Generating ", total_operations, " operations at ",
+          options_.ops_per_second, " ops/s for ", options_.duration_seconds,
+          "s: read fraction ", options_.read_fraction, ", keyspace ",
+          options_.keyspace_size, " documents (",
+          options_.distribution == KeyDistribution::kZipf ? "zipf"
+                                                          : "uniform",
+          ")");
+    }
+
+    start_ = std::chrono::steady_clock::now();
+    auto next_progress_log = start_ + std::chrono::seconds(1);
+    uint64_t next_operation = 0;
+    uint64_t in_flight = 0;
+    uint64_t completed = 0;
+
+    while (next_operation < total_operations || in_flight > 0) {
+      std::vector<PendingOperation*> completed_operations;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto wake_time = next_progress_log;
+        if (next_operation < total_operations) {
+          wake_time = std::min(wake_time, ScheduledTime(next_operation));
+        }
+        condition_.wait_until(lock, wake_time, [this]() {
+          return !completed_operations_.empty();
+        });
+        completed_operations.swap(completed_operations_);
+      }
+
+      for (PendingOperation* operation : completed_operations) {
+        Finish(std::unique_ptr<PendingOperation>(operation));
+        in_flight--;
+        completed++;
+      }
+
+      auto now = std::chrono::steady_clock::now();
+      while (next_operation < total_operations &&
+             ScheduledTime(next_operation) <= now) {
+        Issue(next_operation++, now);
+        in_flight++;
+      }
+
+      if (now >= next_progress_log) {
+        Log("Load generator: issued ", next_operation, ", completed ",
+            completed, ", in flight ", in_flight);
+        next_progress_log += std::chrono::seconds(1);
+      }
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end - start_;
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(2)
+       << total_operations / elapsed_seconds.count() << " ops/s";
+    Log("Load generator completed ", total_operations, " operations in ",
+        FormattedElapsedTime(end - start_), " (", ss.str(), ", max issue lag ",
+        FormattedElapsedTime(std::chrono::nanoseconds(issue_lag_.max())),
+        ")");
+    if (shards_.size() > 1) {
+      LogShards(elapsed_seconds.count());
+    }
+  }
+
+ private:
+  struct PendingOperation {
+    LoadGenerator* generator = nullptr;
+    uint64_t index = 0;
+    Operation operation = Operation::kRead;
+    std::string path;
+    int item_count = 1;
+    std::size_t payload_bytes = 0;
+    std::size_t shard = 0;
+    FutureBase future;
+    Future<DocumentSnapshot> read_future;
+    std::shared_ptr<std::atomic<int>> transaction_attempts;
+    std::chrono::steady_clock::time_point scheduled;
+    std::chrono::steady_clock::time_point end;
+  };
+
+  std::chrono::steady_clock::time_point ScheduledTime(uint64_t index) const {
+    std::chrono::duration<double> offset(index / options_.ops_per_second);
+    if (trace_) {
+      offset = std::chrono::duration<double>(
+          trace_->record(index).offset_nanos * 1e-9 / speed_);
+    }
+    return start_ +
+           std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+               offset);
+  }
+
+  void Issue(uint64_t index, std::chrono::steady_clock::time_point now) {
+    auto* operation = new PendingOperation;
+    operation->generator = this;
+    operation->index = index;
+    operation->scheduled = ScheduledTime(index);
+    issue_lag_.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        now - operation->scheduled));
+
+    const Payload* payload = nullptr;
+    std::vector<const Payload*> batch;
+    if (trace_) {
+      const TraceRecord& record = trace_->record(index);
+      operation->operation = static_cast<Operation>(record.operation);
+      operation->path = trace_->path(record);
+      operation->item_count = static_cast<int>(record.item_count);
+      payload = trace_->payload(record);
+      if (operation->operation == Operation::kBatchWrite) {
+        batch = trace_->batch(record);
+      }
+    } else {
+      bool is_read = std::uniform_real_distribution<double>(0, 1)(rng_) <
+                     options_.read_fraction;
+      operation->operation = is_read ? Operation::kRead : Operation::kWrite;
+      operation->path = DocumentPathForKey(key_chooser_.Choose(rng_),
+                                           options_.keyspace_size);
+      if (!is_read) {
+        payload = &payloads_->Next();
+      }
+    }
+    if (operation->operation == Operation::kBatchWrite) {
+      recorder_.RecordIssue(operation->path, batch);
+    } else {
+      recorder_.RecordIssue(operation->operation, operation->path, payload,
+                            operation->item_count);
+    }
+
+    operation->shard = shards_.IndexForPath(operation->path);
+    Firestore* firestore = shards_.shard(operation->shard);
+    DocumentReference doc = firestore->Document(operation->path);
+    if (operation->operation == Operation::kTransaction) {
+      operation->transaction_attempts = std::make_shared<std::atomic<int>>(0);
+      operation->future =
+          StartTransaction(firestore, doc, operation->transaction_attempts);
+    } else if (operation->operation == Operation::kIncrement) {
+      operation->future = StartIncrement(doc);
+    } else if (operation->operation == Operation::kRead || !payload) {
+      operation->operation = Operation::kRead;
+      operation->read_future =
+          StartRead(doc, SourceForReadMode(policy_.read_mode));
+      operation->future = operation->read_future;
+    } else if (operation->operation == Operation::kBatchWrite) {
+      operation->future = StartBatchWrite(firestore, doc, batch);
+      operation->payload_bytes = TotalPayloadSize(batch);
+    } else {
+      operation->future = StartWrite(doc, *payload);
+      operation->payload_bytes = payload->size;
+    }
+    operation->future.OnCompletion(OnCompletion, operation);
+  }
+
+  void Finish(std::unique_ptr<PendingOperation> operation) {
+    OperationRecord record;
+    record.operation = operation->operation;
+    record.index = operation->index;
+    record.doc_path = operation->path;
+    record.start = operation->scheduled;
+    record.end = operation->end;
+    record.error = operation->future.error();
+    record.item_count = operation->item_count;
+    if (operation->transaction_attempts) {
+      record.transaction_attempts = *operation->transaction_attempts;
+    }
+    if (operation->operation != Operation::kRead) {
+      record.payload_bytes = operation->payload_bytes;
+    } else {
+      record.origin = DataOriginOfRead(operation->read_future);
+    }
+    if (operation->operation == Operation::kRead &&
+        recorder_.writes_results() && record.error == Error::kErrorOk) {
+      MapFieldValue data;
+      record.payload_bytes =
+          ReadDocumentFields(*operation->read_future.result(), policy_.fields,
+                             data, record.result_allocations);
+      record.result_extracted = true;
+    }
+    recorder_.Record(record);
+
+    auto latency = record.latency();
+    shard_latencies_[operation->shard].Record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(latency));
+    if (record.error != Error::kErrorOk) {
+      LogFutureResult(operation->future,
+                      OperationKindName(operation->operation) + " #" +
+                          std::to_string(operation->index + 1) + " of " +
+                          operation->path,
+                      latency);
+    }
+  }
+
+  // Logs how the operations were spread across the shards, so that a shard
+  // whose throughput lags the others, or whose latency grows with the shard
+  // count, stands out.
+  void LogShards(double elapsed_seconds) const {
+    for (std::size_t i = 0; i < shard_latencies_.size(); i++) {
+      const LatencyHistogram& latencies = shard_latencies_[i];
+      std::ostringstream ss;
+      ss << std::fixed << std::setprecision(2)
+         << latencies.count() / elapsed_seconds << " ops/s";
+      Log("Shard ", i + 1, ": ", latencies.count(), " operations (", ss.str(),
+          ", p50 ",
+          FormattedElapsedTime(
+              std::chrono::nanoseconds(latencies.ValueAtPercentile(50))),
+          ", p99 ",
+          FormattedElapsedTime(
+              std::chrono::nanoseconds(latencies.ValueAtPercentile(99))),
+          ")");
+    }
+  }
+
+  static void OnCompletion(const FutureBase&, void* user_data) {
+    auto* operation = static_cast<PendingOperation*>(user_data);
+    operation->end = std::chrono::steady_clock::now();
+    LoadGenerator* generator = operation->generator;
+    std::unique_lock<std::mutex> lock(generator->mutex_);
+    generator->completed_operations_.push_back(operation);
+    generator->condition_.notify_one();
+  }
+
+  const FirestoreShards& shards_;
+  const LoadGeneratorOptions options_;
+  // Null when replaying a trace.
+  PayloadGenerator* const payloads_;
+  // Null unless replaying a trace.
+  const TraceReader* const trace_;
+  const double speed_;
+  const RequestPolicy policy_;
+  OperationRecorder& recorder_;
+  const KeyChooser key_chooser_;
+  std::mt19937_64 rng_;
+  std::chrono::steady_clock::time_point start_;
+  LatencyHistogram issue_lag_;
+  // Indexed by shard, and only touched from the thread calling Run().
+  std::vector<LatencyHistogram> shard_latencies_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::vector<PendingOperation*> completed_operations_;
+};
+
+// Runs the workload described by `args` on the calling thread: either the
+// load generator, whose operations are routed across `shards`, or the list of
+// operations, which all go to the first shard. Returns the process exit code.
+int RunWorkload(const FirestoreShards& shards, const ParsedArguments& args,
+                OperationRecorder& recorder) {
+  Firestore* firestore = shards.shard(0);
+  const std::string key = args.key_valid ? args.key : "TestKey";
+  const std::string value = args.value_valid ? args.value : "TestValue";
+  PayloadGenerator payloads(key, value, args.payload);
+  if (!args.replay_file.empty()) {
+    std::unique_ptr<TraceReader> trace = TraceReader::Open(args.replay_file);
+    if (!trace) {
+      return 1;
+    }
+    LoadGenerator generator(shards, *trace, args.replay_speed,
+                            args.request_policy, recorder);
+    generator.Run();
+    return 0;
+  }
+  if (args.load.ops_per_second > 0) {
+    LoadGenerator generator(shards, args.load, payloads,
+                            args.request_policy, recorder);
+    generator.Run();
+    return 0;
+  }
+
+  DocumentReference doc = firestore->Document("UnityIssue1154TestApp/TestDoc");
+  Log("Performing ", args.workload.operation_count(),
+      " operations on document: ", doc.path());
+  if (args.concurrency > 1) {
+    OperationPipeline pipeline(firestore, doc, payloads, args.concurrency,
+                               args.batch_size, args.request_policy,
+                               recorder);
+    pipeline.Run(args.workload);
+    return 0;
+  }
+  if (args.chains > 0) {
+    OperationChains chains(firestore, doc, payloads, args.chains,
+                           args.executor_threads, args.batch_size,
+                           args.request_policy, recorder);
+    chains.Run(args.workload);
+    return 0;
+  }
+  WorkloadIterator steps(args.workload);
+  WorkloadStep step;
+  std::size_t group_size = 1;
+  for (std::size_t i = 0; steps.Next(step); i += group_size) {
+    if (step.is_sleep) {
+      Sleep(step.sleep);
+      group_size = 0;
+      continue;
+    }
+    Operation operation = step.operation;
+    group_size = TakeOperationGroup(operation, steps, args.batch_size);
+    if (group_size > 1) {
+      DoBatchWrite(firestore, doc, payloads, static_cast<int>(group_size),
+                   args.request_policy, recorder, i);
+      continue;
+    }
+    switch (operation) {
+      case Operation::kRead: {
+        DoRead(doc, args.request_policy, recorder, i);
+        break;
+      }
+      case Operation::kWrite: {
+        DoWrite(doc, payloads.Next(), args.request_policy, recorder, i);
+        break;
+      }
+      case Operation::kListen: {
+        DoListen(doc, key, value, args.listeners, args.request_policy,
+                 recorder, i);
+        break;
+      }
+      case Operation::kTransaction: {
+        DoTransaction(firestore, args.request_policy, recorder, i);
+        break;
+      }
+      case Operation::kIncrement: {
+        DoIncrement(firestore, args.request_policy, recorder, i);
+        break;
+      }
+      case Operation::kQuery: {
+        DoQuery(firestore, args.request_policy, recorder, i);
+        break;
+      }
+      case Operation::kFanOut: {
+        DoFanOutWrite(firestore, payloads, args.fanout, args.request_policy,
+                      recorder, i);
+        break;
+      }
+      case Operation::kDrain: {
+        DoDrain(firestore, payloads, args.offline_writes, args.request_policy,
+                recorder, i);
+        break;
+      }
+      default: {
+        Log("INTERNAL ERROR: unknown value for operation: ",
+            static_cast<int>(operation));
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// A TCP proxy on a loopback port that forwards each connection to the
+// emulator under the given NetworkConditions, so that the slow and lossy
+// connections of issue 1154 can be reproduced against the emulator at will.
+// Data read from either side is queued with the time it is due to be
+// delivered and written by a separate thread, so that the delays of one
+// chunk do not hold back reading the next.
+class NetworkConditioningProxy {
+ public:
+  // Returns null, having logged why, if the proxy cannot listen.
+  static std::unique_ptr<NetworkConditioningProxy> Start(
+      const NetworkConditions& conditions, const std::string& upstream) {
+#ifdef _WIN32
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+      Log("ERROR: WSAStartup() FAILED");
+      return nullptr;
+    }
+#endif
+    std::size_t colon = upstream.rfind(':');
+    std::unique_ptr<NetworkConditioningProxy> proxy(
+        new NetworkConditioningProxy(conditions, upstream.substr(0, colon),
+                                     upstream.substr(colon + 1)));
+    proxy->listener_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    socklen_t address_length = sizeof(address);
+    if (proxy->listener_ == kInvalidSocket ||
+        bind(proxy->listener_, reinterpret_cast<sockaddr*>(&address),
+             sizeof(address)) != 0 ||
+        listen(proxy->listener_, SOMAXCONN) != 0 ||
+        getsockname(proxy->listener_, reinterpret_cast<sockaddr*>(&address),
+                    &address_length) != 0) {
+      Log("ERROR: Starting the network conditioning proxy FAILED");
+      return nullptr;
+    }
+    proxy->port_ = ntohs(address.sin_port);
+    NetworkConditioningProxy* started = proxy.get();
+    proxy->accept_thread_ =
+        std::thread([started]() { started->AcceptConnections(); });
+    return proxy;
+  }
+
+  ~NetworkConditioningProxy() {
+    Stop();
+#ifdef _WIN32
+    WSACleanup();
+#endif
+  }
+
+  NetworkConditioningProxy(const NetworkConditioningProxy&) = delete;
+  NetworkConditioningProxy& operator=(const NetworkConditioningProxy&) =
+      delete;
+
+  // The address to give Settings::set_host() in place of the emulator's.
+  std::string host() const { return "127.0.0.1:" + std::to_string(port_); }
+
+  // Closes every connection and logs what went through the proxy.
+  void Stop() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (stopping_) {
+        return;
+      }
+      stopping_ = true;
+      for (const std::shared_ptr<Connection>& connection : connections_) {
+        connection->Shutdown();
+      }
+    }
+    condition_.notify_all();
+    if (accept_thread_.joinable()) {
+      accept_thread_.join();
+    }
+    if (listener_ != kInvalidSocket) {
+      CloseSocket(listener_);
+    }
+    // Connections accepted just before stopping can still be adding threads.
+    while (true) {
+      std::vector<std::thread> threads;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        threads.swap(threads_);
+      }
+      if (threads.empty()) {
+        break;
+      }
+      for (std::thread& thread : threads) {
+        thread.join();
+      }
+    }
+    Log("Network conditioning proxy: ", connection_count_.load(),
+        " connections, ", bytes_to_upstream_.load(), " bytes sent, ",
+        bytes_to_client_.load(), " bytes received, ", lost_chunks_.load(),
+        " chunks retransmitted");
+  }
+
+ private:
+#ifdef _WIN32
+  typedef SOCKET NativeSocket;
+  static constexpr NativeSocket kInvalidSocket = INVALID_SOCKET;
+  static constexpr int kShutdownBoth = SD_BOTH;
+  static constexpr int kShutdownWrite = SD_SEND;
+  static constexpr int kSendFlags = 0;
+  static void CloseSocket(NativeSocket socket) { closesocket(socket); }
+#else
+  typedef int NativeSocket;
+  static constexpr NativeSocket kInvalidSocket = -1;
+  static constexpr int kShutdownBoth = SHUT_RDWR;
+  static constexpr int kShutdownWrite = SHUT_WR;
+#ifdef MSG_NOSIGNAL
+  static constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+  static constexpr int kSendFlags = 0;
+#endif
+  static void CloseSocket(NativeSocket socket) { close(socket); }
+#endif
+
+  // The minimum retransmission timeout of most TCP stacks, which is what a
+  // lost segment costs on a connection that has otherwise been quiet.
+  static constexpr std::chrono::milliseconds kRetransmissionTimeout{200};
+  static constexpr std::size_t kChunkBytes = 16 * 1024;
+
+  struct Chunk {
+    std::chrono::steady_clock::time_point deliver;
+    // Empty for the end of the stream.
+    std::string data;
+  };
+
+  // One direction of a connection, from `from` to `to`.
+  struct Stream {
+    NativeSocket from;
+    NativeSocket to;
+    std::deque<Chunk> chunks;
+    // When the bandwidth cap lets the next chunk start being delivered.
+    std::chrono::steady_clock::time_point link_free;
+    std::atomic<uint64_t>* bytes;
+  };
+
+  struct Connection {
+    NativeSocket client = kInvalidSocket;
+    NativeSocket upstream = kInvalidSocket;
+    Stream to_upstream;
+    Stream to_client;
+    // Guarded by the proxy's mutex. The sockets are closed only once the
+    // reading and writing threads of both streams have all finished with them.
+    int running_threads = 4;
+    bool closed = false;
+
+    void Shutdown() {
+      if (!closed) {
+        shutdown(client, kShutdownBoth);
+        if (upstream != kInvalidSocket) {
+          shutdown(upstream, kShutdownBoth);
+        }
+      }
+    }
+  };
+
+  NetworkConditioningProxy(const NetworkConditions& conditions,
+                           std::string upstream_host,
+                           std::string upstream_port)
+      : conditions_(conditions),
+        upstream_host_(std::move(upstream_host)),
+        upstream_port_(std::move(upstream_port)) {}
+
+  static std::chrono::steady_clock::duration Seconds(double seconds) {
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(seconds));
+  }
+
+  // Polls so that Stop() need not rely on closing the listening socket to
+  // interrupt accept(), which does not work on every platform.
+  void AcceptConnections() {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (stopping_) {
+          return;
+        }
+      }
+      fd_set readable;
+      FD_ZERO(&readable);
+      FD_SET(listener_, &readable);
+      timeval timeout{0, 100 * 1000};
+      if (select(static_cast<int>(listener_) + 1, &readable, nullptr, nullptr,
+                 &timeout) <= 0) {
+        continue;
+      }
+      NativeSocket client = accept(listener_, nullptr, nullptr);
+      if (client == kInvalidSocket) {
+        continue;
+      }
+      auto connection = std::make_shared<Connection>();
+      connection->client = client;
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (stopping_) {
+        CloseSocket(client);
+        return;
+      }
+      connection_count_++;
+      connections_.push_back(connection);
+      threads_.emplace_back([this, connection]() { Connect(connection); });
+    }
+  }
+
+  // Waits out the connect delay, connects to the emulator and starts
+  // forwarding in both directions.
+  void Connect(std::shared_ptr<Connection> connection) {
+    if (conditions_.connect_delay_seconds > 0) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait_for(lock, Seconds(conditions_.connect_delay_seconds),
+                          [this]() { return stopping_; });
+    }
+    NativeSocket upstream = ConnectUpstream();
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (upstream == kInvalidSocket || stopping_) {
+      if (upstream == kInvalidSocket) {
+        Log("ERROR: Network conditioning proxy connecting to ",
+            upstream_host_, ":", upstream_port_, " FAILED");
+      } else {
+        CloseSocket(upstream);
+      }
+      CloseSocket(connection->client);
+      connection->closed = true;
+      return;
+    }
+    connection->upstream = upstream;
+    connection->to_upstream.from = connection->client;
+    connection->to_upstream.to = upstream;
+    connection->to_upstream.bytes = &bytes_to_upstream_;
+    connection->to_client.from = upstream;
+    connection->to_client.to = connection->client;
+    connection->to_client.bytes = &bytes_to_client_;
+    Stream* streams[] = {&connection->to_upstream, &connection->to_client};
+    for (Stream* stream : streams) {
+      threads_.emplace_back(
+          [this, connection, stream]() { Read(*connection, *stream); });
+      threads_.emplace_back(
+          [this, connection, stream]() { Write(*connection, *stream); });
+    }
+  }
+
+  NativeSocket ConnectUpstream() {
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(upstream_host_.c_str(), upstream_port_.c_str(), &hints,
+                    &addresses) != 0) {
+      return kInvalidSocket;
+    }
+    NativeSocket upstream = kInvalidSocket;
+    for (addrinfo* address = addresses; address; address = address->ai_next) {
+      upstream = socket(address->ai_family, address->ai_socktype,
+                        address->ai_protocol);
+      if (upstream == kInvalidSocket) {
+        continue;
+      }
+      if (connect(upstream, address->ai_addr,
+                  static_cast<socklen_t>(address->ai_addrlen)) == 0) {
+        break;
+      }
+      CloseSocket(upstream);
+      upstream = kInvalidSocket;
+    }
+    freeaddrinfo(addresses);
+    if (upstream != kInvalidSocket) {
+      int enabled = 1;
+      setsockopt(upstream, IPPROTO_TCP, TCP_NODELAY,
+                 reinterpret_cast<const char*>(&enabled), sizeof(enabled));
+    }
+    return upstream;
+  }
+
+  // Queues each chunk read from `stream.from` with the time it is due: after
+  // any earlier chunks have used up the bandwidth, plus the latency, plus a
+  // retransmission timeout if it is "lost".
+  void Read(Connection& connection, Stream& stream) {
+    std::mt19937_64 rng(std::random_device{}());
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::vector<char> buffer(kChunkBytes);
+    while (true) {
+      int received = recv(stream.from, buffer.data(),
+                          static_cast<int>(buffer.size()), 0);
+      auto now = std::chrono::steady_clock::now();
+      Chunk chunk;
+      if (received > 0) {
+        chunk.data.assign(buffer.data(), received);
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      auto sent = std::max(now, stream.link_free);
+      if (conditions_.bandwidth_bytes_per_second > 0) {
+        sent += Seconds(chunk.data.size() /
+                        conditions_.bandwidth_bytes_per_second);
+      }
+      stream.link_free = sent;
+      chunk.deliver = sent + Seconds(conditions_.latency_seconds);
+      if (received > 0 && conditions_.loss > 0 &&
+          uniform(rng) < conditions_.loss) {
+        chunk.deliver += kRetransmissionTimeout;
+        lost_chunks_++;
+      }
+      stream.chunks.push_back(std::move(chunk));
+      condition_.notify_all();
+      if (received <= 0) {
+        Finish(connection);
+        return;
+      }
+    }
+  }
+
+  // Writes each chunk queued by Read() to `stream.to` once it is due; TCP
+  // being in order, a delayed chunk holds back all of those behind it.
+  void Write(Connection& connection, Stream& stream) {
+    bool open = true;
+    bool failed = false;
+    while (open) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait(lock,
+                      [&stream]() { return !stream.chunks.empty(); });
+      auto deliver = stream.chunks.front().deliver;
+      condition_.wait_until(lock, deliver, [this]() { return stopping_; });
+      Chunk chunk = std::move(stream.chunks.front());
+      stream.chunks.pop_front();
+      lock.unlock();
+
+      open = !chunk.data.empty();
+      for (std::size_t offset = 0; offset < chunk.data.size();) {
+        int sent = send(stream.to, chunk.data.data() + offset,
+                        static_cast<int>(chunk.data.size() - offset),
+                        kSendFlags);
+        if (sent <= 0) {
+          open = false;
+          failed = true;
+          break;
+        }
+        offset += sent;
+        *stream.bytes += sent;
+      }
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (failed) {
+      // Nothing more can be delivered, so wake the readers of both streams,
+      // which would otherwise wait on a connection that is already gone.
+      shutdown(connection.client, kShutdownBoth);
+      shutdown(connection.upstream, kShutdownBoth);
+    } else {
+      shutdown(stream.to, kShutdownWrite);
+    }
+    Finish(connection);
+  }
+
+  // Called with the mutex held by each of a connection's threads as it exits.
+  void Finish(Connection& connection) {
+    if (--connection.running_threads == 0) {
+      CloseSocket(connection.client);
+      CloseSocket(connection.upstream);
+      connection.closed = true;
+    }
+  }
+
+  const NetworkConditions conditions_;
+  const std::string upstream_host_;
+  const std::string upstream_port_;
+  NativeSocket listener_ = kInvalidSocket;
+  int port_ = 0;
+  std::atomic<uint64_t> connection_count_{0};
+  std::atomic<uint64_t> bytes_to_upstream_{0};
+  std::atomic<uint64_t> bytes_to_client_{0};
+  std::atomic<uint64_t> lost_chunks_{0};
+  // Guards everything below and the streams of every connection.
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  bool stopping_ = false;
+  std::vector<std::shared_ptr<Connection>> connections_;
+  std::vector<std::thread> threads_;
+  std::thread accept_thread_;
+};
+
+constexpr std::chrono::milliseconds
+    NetworkConditioningProxy::kRetransmissionTimeout;
+
+void ConfigureFirestore(Firestore* firestore, const ParsedArguments& args) {
+  Settings settings = firestore->settings();
+  if (args.use_emulator) {
+    Log("Using the Firestore Emulator");
+    settings.set_host(args.emulator_host);
+    settings.set_ssl_enabled(false);
+  }
+  if (args.persistence_enabled_valid) {
+    Log("Setting persistence: ", args.persistence_enabled ? "on" : "off");
+    settings.set_persistence_enabled(args.persistence_enabled);
+  }
+  if (args.cache_size_bytes_valid) {
+    Log("Setting cache size bytes: ", args.cache_size_bytes);
+    settings.set_cache_size_bytes(args.cache_size_bytes);
+  }
+  if (args.use_emulator || args.persistence_enabled_valid ||
+      args.cache_size_bytes_valid) {
+    firestore->set_settings(settings);
+  }
+}
+
+// Creates the `args.shards - 1` named Apps and Firestore instances that,
+// along with `firestore`, make up the shards. Returns null on failure.
+std::unique_ptr<FirestoreShards> CreateShards(App* app, Firestore* firestore,
+                                              const ParsedArguments& args) {
+  std::unique_ptr<FirestoreShards> shards(new FirestoreShards(firestore));
+  for (int i = 1; i < args.shards; i++) {
+    std::string name = "shard-" + std::to_string(i + 1);
+    Log("Creating firebase::App and firebase::firestore::Firestore for ",
+        name);
+    std::unique_ptr<App> shard_app(App::Create(app->options(), name.c_str()));
+    if (!shard_app) {
+      Log("ERROR: Creating firebase::App ", name, " FAILED!");
+      return nullptr;
+    }
+    std::unique_ptr<Firestore> shard_firestore(
+        Firestore::GetInstance(shard_app.get(), nullptr));
+    if (!shard_firestore) {
+      Log("ERROR: Creating firebase::firestore::Firestore ", name,
+          " FAILED!");
+      return nullptr;
+    }
+    ConfigureFirestore(shard_firestore.get(), args);
+    shards->Add(std::move(shard_app), std::move(shard_firestore));
+  }
+  return shards;
+}
+
+void WarmUpShards(const FirestoreShards& shards) {
+  for (std::size_t i = 0; i < shards.size(); i++) {
+    WarmUpConnection(shards.shard(i));
+  }
+}
+
+// Runs the workload on `args.threads` worker threads at once, all sharing
+// `shards` or each with its own named App and Firestore instance,
+// depending on `args.topology`. Returns the process exit code.
+int RunWorkers(App* app, const FirestoreShards& shards,
+               const ParsedArguments& args, OperationRecorder& recorder) {
+  std::vector<std::unique_ptr<App>> worker_apps;
+  std::vector<std::unique_ptr<Firestore>> worker_firestores;
+  std::vector<std::unique_ptr<FirestoreShards>> worker_shards;
+  std::vector<const FirestoreShards*> firestores(args.threads, &shards);
+  if (args.topology == ThreadTopology::kPerThread) {
+    for (int i = 0; i < args.threads; i++) {
+      std::string name = "worker-" + std::to_string(i + 1);
+      Log("Creating firebase::App and firebase::firestore::Firestore for ",
+          name);
+      std::unique_ptr<App> worker_app(
+          App::Create(app->options(), name.c_str()));
+      if (!worker_app) {
+        Log("ERROR: Creating firebase::App ", name, " FAILED!");
+        return 1;
+      }
+      std::unique_ptr<Firestore> worker_firestore(
+          Firestore::GetInstance(worker_app.get(), nullptr));
+      if (!worker_firestore) {
+        Log("ERROR: Creating firebase::firestore::Firestore ", name,
+            " FAILED!");
+        return 1;
+      }
+      ConfigureFirestore(worker_firestore.get(), args);
+      worker_shards.emplace_back(
+          new FirestoreShards(worker_firestore.get()));
+      firestores[i] = worker_shards.back().get();
+      worker_apps.push_back(std::move(worker_app));
+      worker_firestores.push_back(std::move(worker_firestore));
+    }
+  }
+
+  // The shared instance only needs warming up once; separate instances each
+  // warm up their own connection on their worker thread.
+  if (args.warmup && args.topology == ThreadTopology::kShared) {
+    WarmUpShards(shards);
+  }
+
+  Log("Starting ", args.threads, " worker threads (",
+      args.topology == ThreadTopology::kShared
+          ? "sharing one Firestore instance"
+          : "one Firestore instance per thread",
+      ")");
+  auto start = std::chrono::steady_clock::now();
+  std::vector<int> results(args.threads, 0);
+  std::vector<std::thread> workers;
+  for (int i = 0; i < args.threads; i++) {
+    workers.emplace_back([i, &args, &firestores, &recorder, &results]() {
+      CurrentWorker() = i + 1;
+      if (args.warmup && args.topology == ThreadTopology::kPerThread) {
+        WarmUpShards(*firestores[i]);
+      }
+      results[i] = RunWorkload(*firestores[i], args, recorder);
+      Log("Worker thread ", i + 1, " finished");
+    });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed_seconds = end - start;
+  uint64_t operation_count = recorder.stats().operation_count();
+  std::ostringstream ss;
+  ss << std::fixed << std::setprecision(2)
+     << (elapsed_seconds.count() > 0
+             ? operation_count / elapsed_seconds.count()
+             : 0.0);
+  Log("All ", args.threads, " worker threads finished ", operation_count,
+      " operations in ", FormattedElapsedTime(end - start), " (", ss.str(),
+      " ops/s aggregate)");
+
+  worker_shards.clear();
+  worker_firestores.clear();
+  worker_apps.clear();
+  for (int result : results) {
+    if (result != 0) {
+      return result;
+    }
+  }
   return 0;
 }
+
+int main(int argc, char** argv) {
+  StartupProfile startup_profile;
+  ParsedArguments args;
+  try {
+    args = ParseArguments(argc, argv);
+  } catch (ArgParseException& e) {
+    Log("ERROR: Invalid command-line arguments: ", e.what());
+    return 2;
+  }
+
+  if (args.help_text.size() > 0) {
+    std::cout << args.help_text;
+    return 0;
+  }
+
+  TimestampFormatter::set_precision(args.timestamp_precision);
+  std::unique_ptr<AsyncLogWriter> async_log_writer;
+  if (args.async_logging) {
+    async_log_writer.reset(new AsyncLogWriter);
+    Log("Enabled asynchronous logging");
+  }
+
+  if (args.debug_logging_enabled) {
+    Log("Enabling debug logging");
+    SetLogLevel(LogLevel::kLogLevelDebug);
+    Firestore::set_log_level(LogLevel::kLogLevelDebug);
+  }
+
+  std::unique_ptr<ChromeTraceWriter> chrome_trace;
+  if (!args.chrome_trace_file.empty()) {
+    chrome_trace = ChromeTraceWriter::Open(args.chrome_trace_file);
+    if (!chrome_trace) {
+      Log("ERROR: Opening Chrome trace file FAILED: ", args.chrome_trace_file);
+      return 1;
+    }
+  }
+
+  std::unique_ptr<ResourceSampler> resource_sampler;
+  if (args.sample_interval_seconds > 0) {
+    resource_sampler = ResourceSampler::Start(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(args.sample_interval_seconds)),
+        args.results_format, args.samples_file);
+    if (!resource_sampler) {
+      Log("ERROR: Opening resource samples file FAILED: ", args.samples_file);
+      return 1;
+    }
+  }
+
+  // Started before the App so that it outlives every Firestore instance.
+  std::unique_ptr<NetworkConditioningProxy> proxy;
+  if (args.network.enabled()) {
+    proxy = NetworkConditioningProxy::Start(args.network, args.emulator_host);
+    if (!proxy) {
+      return 1;
+    }
+    Log("Connecting to the emulator through the network conditioning proxy "
+        "at ", proxy->host());
+    args.emulator_host = proxy->host();
+  }
+
+  // Measured before and after the run, to show what persistence costs on disk.
+  const std::string data_directory = FirestoreDataDirectory();
+  const uint64_t data_bytes_before = DirectorySizeBytes(data_directory);
+
+  const bool profile_startup = !args.startup_profile_file.empty();
+  Log("Creating firebase::App");
+  auto phase_start = std::chrono::steady_clock::now();
+  std::unique_ptr<App> app(App::Create(AppOptions()));
+  startup_profile.Record("app_create", phase_start,
+                         std::chrono::steady_clock::now());
+  if (!app) {
+    Log("ERROR: Creating firebase::App FAILED!");
+    return 1;
+  }
+
+  std::unique_ptr<Auth> auth;
+  if (profile_startup) {
+    Log("Creating firebase::auth::Auth");
+    phase_start = std::chrono::steady_clock::now();
+    auth.reset(Auth::GetAuth(app.get(), nullptr));
+    startup_profile.Record("auth_get_auth", phase_start,
+                           std::chrono::steady_clock::now());
+  }
+
+  Log("Creating firebase::firestore::Firestore");
+  int threads_before_firestore =
+      resource_sampler ? ResourceUsage::Current().thread_count : -1;
+  phase_start = std::chrono::steady_clock::now();
+  std::unique_ptr<Firestore> firestore(
+      Firestore::GetInstance(app.get(), nullptr));
+  startup_profile.Record("firestore_get_instance", phase_start,
+                         std::chrono::steady_clock::now());
+  if (threads_before_firestore >= 0) {
+    int threads = ResourceUsage::Current().thread_count;
+    Log("Firestore::GetInstance() started ",
+        threads - threads_before_firestore, " threads (", threads,
+        " in total)");
+  }
+  if (!firestore) {
+    Log("ERROR: Creating firebase::firestore::Firestore FAILED!");
+    return 1;
+  }
+
+  phase_start = std::chrono::steady_clock::now();
+  ConfigureFirestore(firestore.get(), args);
+  startup_profile.Record("set_settings", phase_start,
+                         std::chrono::steady_clock::now());
+
+  if (profile_startup) {
+    ProfileFirstOperations(auth.get(), firestore.get(), startup_profile);
+  }
+  startup_profile.LogPhases();
+  if (profile_startup &&
+      !startup_profile.WriteJson(args.startup_profile_file)) {
+    Log("ERROR: Writing startup profile FAILED: ", args.startup_profile_file);
+    return 1;
+  }
+
+  std::unique_ptr<ResultsWriter> results_writer;
+  if (args.results_format_valid) {
+    results_writer =
+        ResultsWriter::Open(args.results_format, args.results_file);
+    if (!results_writer) {
+      Log("ERROR: Opening results output file FAILED: ", args.results_file);
+      return 1;
+    }
+  }
+  std::unique_ptr<TraceWriter> trace_writer;
+  if (!args.record_file.empty()) {
+    trace_writer = TraceWriter::Open(args.record_file);
+    if (!trace_writer) {
+      Log("ERROR: Creating trace file FAILED: ", args.record_file);
+      return 1;
+    }
+  }
+  OperationRecorder recorder(results_writer.get(), trace_writer.get());
+
+  if (args.workload.Contains(Operation::kTransaction) ||
+      args.workload.Contains(Operation::kIncrement)) {
+    Log("Incrementing ", args.request_policy.hot_documents,
+        " hot documents from ",
+        args.threads * std::max(args.concurrency, args.chains),
+        " concurrent workers");
+  }
+  std::unique_ptr<FirestoreShards> shards =
+      CreateShards(app.get(), firestore.get(), args);
+  if (!shards) {
+    return 1;
+  }
+  if (args.shards > 1) {
+    Log("Routing operations across ", args.shards,
+        " Firestore instances by document path");
+  }
+  int result = 0;
+  if (args.threads > 1) {
+    result = RunWorkers(app.get(), *shards, args, recorder);
+  } else {
+    if (args.warmup) {
+      WarmUpShards(*shards);
+    }
+    result = RunWorkload(*shards, args, recorder);
+  }
+  if (trace_writer && !trace_writer->Close()) {
+    result = 1;
+  }
+  if (resource_sampler) {
+    resource_sampler->Stop();
+  }
+  if (chrome_trace && !chrome_trace->Close()) {
+    Log("ERROR: Writing Chrome trace file FAILED: ", args.chrome_trace_file);
+    result = 1;
+  }
+  if (result == 0) {
+    recorder.stats().LogSummary();
+    if (resource_sampler) {
+      resource_sampler->LogSummary();
+    }
+    uint64_t data_bytes = DirectorySizeBytes(data_directory);
+    uint64_t rss_bytes = ResourceUsage::Current().rss_bytes;
+    // The kernel updates the peak lazily, so it can trail the current RSS.
+    Log("Persistence ",
+        firestore->settings().is_persistence_enabled() ? "on" : "off",
+        ": RSS ", FormattedMebibytes(rss_bytes), " (peak ",
+        FormattedMebibytes(std::max(rss_bytes, PeakResidentSetBytes())), "), ",
+        FormattedMebibytes(data_bytes), " on disk in ", data_directory, " (",
+        data_bytes >= data_bytes_before ? "+" : "-",
+        FormattedMebibytes(data_bytes >= data_bytes_before
+                               ? data_bytes - data_bytes_before
+                               : data_bytes_before - data_bytes),
+        " this run)");
+  }
+  return result;
+}